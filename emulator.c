@@ -36,29 +36,257 @@
    ********************************************************************* */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 #include "emulator.h"
-#include "gbn.h"
+#include "protocol.h"
+#include "legacy.h"
+#include "fec.h"
 
 struct event {
   float evtime;           /* event time */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
-  struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  int flow;               /* flow the event belongs to */
+  struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event.  A packet is
+                             allocated along with its event, just after it, with
+                             room for its payload only (see eventwithpkt()) */
+  int hop;                /* for a packet on a multi-hop path, the hops it has crossed */
+  unsigned long evseq;    /* order of insertion, breaks ties between equal evtimes */
+  int heapidx;            /* where the event sits in evheap */
+  float created;          /* time the event was scheduled at */
+  int creator;            /* entity whose event scheduled it */
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* the event list is a binary heap ordered on evtime, so that inserting and
+   removing an event costs O(log n) however many flows are running.  Events
+   with equal times come out newest first, as they did on the sorted list.
+   Each logical process (see below) has a heap of its own */
+static __thread struct event **evheap = NULL;
+static __thread int evcount = 0;            /* events in the heap */
+static __thread int evsize = 0;             /* slots allocated in evheap */
+static __thread unsigned long evinserted = 0;
+
+/* the timer (if any) running for each flow at A and B, indexed by
+   AorB*nflows + flow, so that timers are found without a search */
+static struct event **timers;
+
+/* arrival time of the last packet scheduled towards A and towards B.
+   All flows share the medium, so packets of every flow queue behind it */
+static float lastarrival[2];
+
+/* Queue-limited link (-q).  Each direction of the medium holds at most
+   qlimit packets, and one sent while it is full is dropped at the tail.
+   The sender keeps the arrival times of the packets it has in the medium,
+   which leave in that order since the medium does not reorder */
+static int qlimit;                /* 0 for no limit */
+static float *queued[2];          /* by receiver: ring of arrival times */
+static int queuedfirst[2], queuedcount[2];
+
+/* Pacing (-s).  A's packets go into the medium no closer together than
+   RTT / (PACEGAIN * window), however the protocol sent them: a window
+   resent on a timeout, or let go by one cumulative ACK, is spread over
+   half the round trip instead of leaving back to back.  The gain keeps the
+   pacer from holding a sender below its window, since the protocol's RTT
+   is its timeout and the real round trip is shorter.  Held packets wait in
+   their arrival events, in a queue per flow, and a PACE event lets the
+   next one go */
+#define PACEGAIN 2.0
+struct pacer {
+  struct event **waiting;         /* ring of the flow's held packets */
+  int first, count, size;
+  float next;                     /* when the next may go */
+};
+static struct pacer *pacers;      /* by flow, NULL when not pacing */
+static float paceinterval;
+static double pacedsum;           /* time A's packets were held, summed */
+
+/* Multi-hop path (-H).  The medium above becomes the access link from the
+   sender to the first of a line of store-and-forward nodes.  Each node
+   sends on to the next, and the last one to the receiver, over a link of
+   its own: rate bytes per time unit, a fixed delay, a loss probability and
+   room for qlimit packets, the one being sent included.  Packets for B
+   cross the nodes first to last, those for A last to first, and the two
+   directions have separate queues.  A node's link is FIFO and its times
+   are fixed once a packet is in the queue, so the packet's departure is
+   worked out when it arrives and its event moves straight on to the next
+   node.  The counts are by receiver */
+struct hop {
+  double rate, delay, loss;
+  int qlimit;
+  float busyuntil[2];             /* when the link is done with what it holds */
+  float *departs[2];              /* ring of the departure times of those */
+  int first[2], count[2];
+  int arrived[2], lost[2], dropped[2], maxqueue[2];
+  double busy[2];                 /* time spent sending */
+  double qdelaysum[2];            /* time waited behind packets ahead, summed */
+};
+static struct hop *hops;          /* in order from A to B */
+static int nhops;
+
+/* Partitioned runs (-p).  The emulator normally draws every random number
+   from the one random() stream in the global order of events, so no two
+   events can be handled at once without changing the results.  With -p
+   each entity draws from a stream of its own, and events due at the same
+   time are ordered by when and by whom they were scheduled rather than by
+   when they were inserted.  A and B then become two logical processes
+   that only affect each other through packets in the channel, and the
+   channel takes at least one time unit, so both can safely run every
+   event due before the earliest pending event plus one.  -p 1 runs the
+   processes on the ordinary sequential engine; -p 2 runs each on a thread
+   of its own (link with -pthread), one such window at a time, and gives
+   exactly the same results, though the two traces may interleave. */
+struct lp {
+  unsigned short stream[3];       /* erand48 state of the entity's random numbers */
+  struct event **outbox;          /* packets sent to the other process this window */
+  int outcount, outsize;
+  float *accepttimes;             /* messages accepted this window, see flushaccepts() */
+  int *acceptflows;
+  int acceptcount, acceptsize;
+  float next;                     /* time of the first event in the heap, -1 if none */
+  float last;                     /* time of the last event handled */
+  float stopat;                   /* B: when A is to stop taking messages, see ssobserve() */
+  char pad[64];                   /* keep the two processes off each other's cache lines */
+};
+
+static struct lp lps[2];
+static int partitioned = 0;       /* logical processes requested by -p, 0 for none */
+static __thread int curlp = A;    /* entity whose event is being handled */
+static pthread_barrier_t lpbarrier;
+
+/* Self-profiler, compiled in with -DPROFILE and to nothing otherwise.  It
+   counts the calls to each event type's handling, to the emulator's entry
+   points and to the protocol's routines, with the clock_gettime()
+   nanoseconds spent in them and the heap levels they sifted through, and
+   prints a table after each run.  Times include what a call calls: a
+   layer 3 event includes B_input, which includes tolayer3, which includes
+   insertevent.  The counts are kept per logical process, so that the
+   threads of -p 2 never share one */
+#ifdef PROFILE
+#define PROF_EVENT      0         /* + event type, 5 of them */
+#define PROF_INSERT     5
+#define PROF_REMOVE     6
+#define PROF_TOLAYER3   7
+#define PROF_START      8
+#define PROF_STOP       9
+#define PROF_AOUTPUT    10
+#define PROF_AINPUT     11
+#define PROF_BINPUT     12
+#define PROF_ATIMER     13
+#define PROF_SLOTS      14
+
+static const char *profnames[PROF_SLOTS] = {
+  "timer event", "layer 5 event", "layer 3 event", "pace event", "hop event",
+  "insertevent", "removeevent", "tolayer3", "starttimer", "stoptimer",
+  "A_output", "A_input", "B_input", "A_timerinterrupt"
+};
+
+struct profslot {
+  long calls;
+  long steps;                     /* heap levels sifted */
+  double ns;
+};
+
+struct profmark {
+  struct timespec t;
+  long steps;
+};
+
+static struct profslot prof[2][PROF_SLOTS];  /* by logical process */
+static long profsteps[2];         /* heap levels sifted so far */
+static double profrun;            /* nanoseconds of the whole run */
+
+static double profsince(const struct profmark *m)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - m->t.tv_sec) * 1e9 + (now.tv_nsec - m->t.tv_nsec);
+}
+
+static void profbegin(struct profmark *m)
+{
+  m->steps = profsteps[curlp];
+  clock_gettime(CLOCK_MONOTONIC, &m->t);
+}
+
+static void profend(int slot, const struct profmark *m)
+{
+  struct profslot *p = &prof[curlp][slot];
+
+  p->ns += profsince(m);
+  p->calls++;
+  p->steps += profsteps[curlp] - m->steps;
+}
+
+/* the table for the run, A's and B's counts together */
+static void profreport(void)
+{
+  struct profslot *a, *b;
+  double ns;
+  long calls;
+  int i;
+
+  printf("profile of the run, %.3f ms, times including what is called:\n", profrun / 1e6);
+  printf("  %-18s %10s %10s %10s %6s %11s\n", "", "calls", "ns/call", "total ms", "%run", "sifts/call");
+  for (i=0; i<PROF_SLOTS; i++) {
+    a = &prof[A][i];
+    b = &prof[B][i];
+    calls = a->calls + b->calls;
+    if (calls == 0)
+      continue;
+    ns = a->ns + b->ns;
+    printf("  %-18s %10ld %10.1f %10.3f %6.1f %11.2f\n", profnames[i], calls, ns / calls,
+           ns / 1e6, profrun > 0.0 ? 100.0 * ns / profrun : 0.0,
+           (double)(a->steps + b->steps) / calls);
+  }
+}
+
+#define PROF_BEGIN(m)     struct profmark m; profbegin(&m)
+#define PROF_END(slot, m) profend(slot, &m)
+#define PROF_STEP()       (profsteps[curlp]++)
+#define PROF_RESET()      (memset(prof, 0, sizeof prof), memset(profsteps, 0, sizeof profsteps))
+#define PROF_RUN(m)       (profrun = profsince(&m))
+#define PROF_REPORT()     profreport()
+#else
+#define PROF_BEGIN(m)
+#define PROF_END(slot, m)
+#define PROF_STEP()
+#define PROF_RESET()
+#define PROF_RUN(m)
+#define PROF_REPORT()
+#endif
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  PACE            3
+#define  HOP             4
 
 #define  OFF             0
 #define  ON              1
 
 int TRACE = 3;
+int mtu = 20;                     /* payload bytes per packet (-m) */
+int nflows = 1;                   /* flows sharing the link (-f) */
+int nacks = 0;                    /* B sends NACKs, in the second run of each pair of -N */
+int fec = 0;                      /* packets per parity packet, in the second run of each pair of -F */
+int rcvbuf = 0;                   /* bytes of B's layer 5 buffer per flow (-B), 0 for no limit */
+static double drainrate;          /* bytes per time unit B's layer 5 takes out of it */
+
+#define PKTHEADER ((int)offsetof(struct pkt, payload))  /* bytes of header on the wire */
 
 /* statistics updated by GBN */
 int window_full;   /* count of the number of messages dropped due to full window */
@@ -66,6 +294,11 @@ int total_ACKs_received;
 int packets_resent;       /* count of the number of packets resent  */
 int new_ACKs;           /* count of the number of acks correctly received */
 int packets_received;  /* count of the packets received by receiver */
+int nacks_sent;        /* count of the NACKs sent by B */
+int nack_resends;      /* count of the packets resent on a NACK */
+int parity_sent;       /* count of the parity packets sent by A */
+int fec_recovered;     /* count of the lost packets B rebuilt from parity */
+int probes_sent;       /* count of the zero window probes sent by A */
 
 /* statistics updated by emulator */
 static int packets_lost;  
@@ -73,28 +306,107 @@ static int packets_corrupt;
 static int packets_sent;
 static int packets_timeout;
 static int messages_delivered;
+static long bytes_tolayer3[2];    /* header + payload bytes handed to layer 3, by sender */
+static long bytes_delivered;      /* message bytes handed to layer 5 at B */
+static double latency_sum;        /* accept to delivery delay, summed over messages */
+static float latency_max;
+
+/* statistics kept by the emulator for each flow */
+struct flowstat {
+  int offered;            /* messages generated by layer 5 */
+  int accepted;           /* messages A took rather than dropped */
+  int delivered;          /* messages handed to layer 5 at B */
+  long bytes;             /* message bytes handed to layer 5 at B */
+  int sent;               /* packets A sent into layer 3, resends included */
+  int timeouts;           /* timer interrupts at A */
+  float *accepttimes;     /* when each accepted, undelivered message was accepted */
+  int acceptfirst;        /* ring buffer: oldest entry */
+  int acceptcount;        /* ring buffer: entries in use */
+  int acceptsize;         /* ring buffer: entries allocated */
+  double buffered;        /* bytes in B's layer 5 buffer (-B) */
+  float drained;          /* the time it was last drained to */
+  double bufferarea;      /* buffered integrated over time */
+  double buffermax;       /* most bytes it held */
+  int shut;               /* B's last ACK advertised a window of 0 */
+  float shutsince;        /* since when */
+  double shuttime;        /* time B's window was shut before that */
+};
+
+static struct flowstat *flowstats;
 
 static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
 static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
+static __thread float simtime = 0.000;
 static float lossprob;            /* probability that a packet is dropped  */
 static float corruptprob;   /* probability that one bit is packet is flipped */
 static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
 static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
+static int msgsize = 20;    /* bytes in each layer 5 message (-l) */
+static char *msgdata;       /* the message handed to layer 4 */
+static float snapat;        /* save a snapshot before the first event after this time (-S) */
+static char *snapout;       /* file to save it to, NULL once saved */
+static char *snapin;        /* snapshot to start from (-R) */
+static float stopat = -1.0; /* no more messages from layer 5 from this time on (-c) */
+
+/* how layer 5 offers messages (-g).  UNIFORM is the original generator */
+#define  UNIFORM   0          /* gaps uniform on [0,2*lambda] */
+#define  POISSON   1          /* gaps exponential with mean lambda */
+#define  ONOFF     2          /* poisson while on, silent while off */
+#define  TRACE5    3          /* arrival times read from a file */
+#define  BACKLOG   4          /* always a message waiting for A */
+static int generator = UNIFORM;
+static double onmean, offmean; /* mean length of on and off periods (ONOFF) */
+static double *onend;       /* by flow: when the current on period ends (ONOFF) */
+static FILE *tracein;       /* the arrival times (TRACE5) */
+
+/* the protocols to run (-P), one after another, each with a window */
+struct run {
+  const struct protocol *proto;
+  int window;
+  int nacks;                  /* with B sending NACKs */
+  int fec;                    /* with a parity packet after every fec */
+  int pace;                   /* with A's packets paced */
+};
+static struct run *runs;
+static int nruns;
+static int pairnacks;         /* each protocol runs without and then with NACKs (-N) */
+static int pairfec;           /* or FEC, with this many packets per parity packet (-F) */
+static int pairpace;          /* or pacing (-s) */
+static int pacing;            /* the run now is paced */
+static int lasttimeouts;      /* timeouts of the run before, the one without */
+static double lastgoodput;    /* and its goodput */
+static double lastqdelay;     /* its average queueing delay A->B */
+static int lastlost;          /* and the packets lost A->B */
+static const struct protocol *proto;  /* the one running now */
+static void *pstate;                  /* and its instance */
+static int window;
+/* the medium's counts are kept by sender, so that A and B never share one */
+static int   ntolayer3[2];        /* number sent into layer 3 */
+static int   nlost[2];            /* number lost in media */
+static int ncorrupt[2];           /* number corrupted by media*/
+static int narrived[2];           /* number handed to the entity, by receiver */
+static int nqdropped[2];          /* number of those lost dropped at a full queue */
+static double qdelaysum[2];       /* time waited behind packets ahead, summed */
+static float qdelaymax[2];
+
+/* the state of random(), kept here rather than inside the C library so that
+   a snapshot can take it along.  With 128 bytes, as srand() used, the
+   numbers are the ones rand() gave */
+static unsigned int rngstate[32];
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
 /* isolate all random number generation in one location.  We assume that the*/
-/* system-supplied rand() function return an int in therange [0,mmm]        */
+/* system-supplied random() function return an int in therange [0,mmm]      */
 /****************************************************************************/
 double jimsrand(void) 
 {
   double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
+  if (partitioned)
+    x = erand48(lps[curlp].stream);  /* the stream of the entity at hand */
+  else
+    x = random()/mmm;          /* x should be uniform in [0,1] */
   if (TRACE > 3)
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
   return(x);
@@ -104,60 +416,220 @@ double jimsrand(void)
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
+/* true if p is due before q */
+static int evbefore(const struct event *p, const struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return p->evtime < q->evtime;
+  if (partitioned) {
+    /* newest first still, but in an order both engines agree on */
+    if (p->created != q->created)
+      return p->created > q->created;
+    if (p->creator != q->creator)
+      return p->creator > q->creator;
+  }
+  return p->evseq > q->evseq;
+}
+
+/* put the event at slot i of the heap */
+static void evplace(struct event *p, int i)
+{
+  evheap[i] = p;
+  p->heapidx = i;
+}
+
+/* move the event at slot i towards the root until its parent is due first */
+static void siftup(int i)
+{
+  struct event *p = evheap[i];
+
+  while (i > 0 && evbefore(p, evheap[(i-1)/2])) {
+    PROF_STEP();
+    evplace(evheap[(i-1)/2], i);
+    i = (i-1)/2;
+  }
+  evplace(p, i);
+}
+
+/* move the event at slot i towards the leaves until both children are due after it */
+static void siftdown(int i)
+{
+  struct event *p = evheap[i];
+  int child;
+
+  while ((child = 2*i + 1) < evcount) {
+    if (child + 1 < evcount && evbefore(evheap[child+1], evheap[child]))
+      child++;
+    if (!evbefore(evheap[child], p))
+      break;
+    PROF_STEP();
+    evplace(evheap[child], i);
+    i = child;
+  }
+  evplace(p, i);
+}
+
+/* add the event to this process's heap */
+static void heapinsert(struct event *p)
+{
+  if (evcount == evsize) {
+    evsize = evsize ? 2*evsize : 64;
+    evheap = realloc(evheap, evsize * sizeof(struct event *));
+    if (evheap == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  p->evseq = evinserted++;
+  evplace(p, evcount++);
+  siftup(p->heapidx);
+}
+
+/* hold a packet for the other process until the end of the window */
+static void postevent(struct lp *lp, struct event *p)
+{
+  if (lp->outcount == lp->outsize) {
+    lp->outsize = lp->outsize ? 2*lp->outsize : 64;
+    lp->outbox = realloc(lp->outbox, lp->outsize * sizeof(struct event *));
+    if (lp->outbox == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  lp->outbox[lp->outcount++] = p;
+}
+
 void insertevent(struct event *p)
 {
-  struct event *q,*qold;
+  PROF_BEGIN(m);
 
   if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
+    printf("            INSERTEVENT: time is %f\n",simtime);
     printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  p->created = simtime;
+  p->creator = curlp;
+  if (partitioned < 2 || p->eventity == curlp)
+    heapinsert(p);
+  else
+    postevent(&lps[curlp], p);
+  PROF_END(PROF_INSERT, m);
+}
+
+/* take the event at slot i out of the heap and return it */
+static struct event *removeevent(int i)
+{
+  struct event *p = evheap[i];
+  PROF_BEGIN(m);
+
+  evcount--;
+  if (i != evcount) {
+    evplace(evheap[evcount], i);
+    siftdown(i);
+    siftup(evheap[i]->heapidx);
   }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
-    }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
-    }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+  PROF_END(PROF_REMOVE, m);
+  return p;
+}
+
+/* natural log of x > 0, without needing the math library: scale x into
+   [0.5,1] by powers of two, then sum the series of 2*atanh((x-1)/(x+1)) */
+static double lnx(double x)
+{
+  double z, z2, term, sum;
+  int k = 0, n;
+
+  while (x > 1.0) {
+    x /= 2;
+    k++;
+  }
+  while (x < 0.5) {
+    x *= 2;
+    k--;
+  }
+  z = (x - 1) / (x + 1);     /* |z| <= 1/3 */
+  z2 = z*z;
+  term = z;
+  sum = 0.0;
+  for (n = 1; n < 40; n += 2) {
+    sum += term / n;
+    term *= z2;
+  }
+  return 2*sum + k*0.69314718055994530942;
+}
+
+/* a gap exponential with the given mean */
+static double expgap(double mean)
+{
+  double u = jimsrand();
+
+  if (u >= 1.0)              /* random() can return RAND_MAX */
+    u = 0.0;
+  return -mean*lnx(1.0 - u);
+}
+
+/* read the next arrival of a trace: a time and, optionally, a flow.
+   Returns 0 once the trace is used up */
+static int nexttrace(double *t, int *flow)
+{
+  char line[256];
+
+  while (fgets(line, sizeof line, tracein) != NULL) {
+    *flow = 0;
+    if (sscanf(line, "%lf %d", t, flow) < 1)
+      continue;               /* blank line or comment */
+    if (*flow < 0 || *flow >= nflows) {
+      printf("trace arrival at %f is for flow %d, but there are %d flows.\n", *t, *flow, nflows);
+      exit(EXIT_FAILURE);
     }
+    return 1;
   }
+  return 0;
 }
 
-void generate_next_arrival(void)
+void generate_next_arrival(int flow)
 {
-  double x;
+  double x, t, start;
   struct event *evptr;
 
   if (TRACE>2)
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-  /* having mean of lambda        */
+  switch (generator) {
+  case POISSON:
+    x = expgap(lambda);
+    break;
+  case ONOFF:
+    /* an arrival that falls past the end of the on period is dropped, and
+       the chain goes on from the start of the next one */
+    t = simtime + expgap(lambda);
+    while (t > onend[flow]) {
+      start = onend[flow] + expgap(offmean);
+      onend[flow] = start + expgap(onmean);
+      t = start + expgap(lambda);
+    }
+    x = t - simtime;
+    break;
+  case TRACE5:
+    if (!nexttrace(&t, &flow))
+      return;                 /* no more arrivals */
+    x = t > simtime ? t - simtime : 0.0;
+    break;
+  case BACKLOG:
+    x = 0.0;                  /* only ever called from init() */
+    break;
+  default:
+    x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+    /* having mean of lambda        */
+  }
   evptr = malloc(sizeof(struct event));
   if (evptr == 0) {
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
-  evptr->evtime =  time + x;
+  evptr->evtime =  simtime + x;
   evptr->evtype =  FROM_LAYER5;
+  evptr->flow = flow;
   if (BIDIRECTIONAL && (jimsrand()>0.5) )
     evptr->eventity = B;
   else
@@ -168,18 +640,17 @@ void generate_next_arrival(void)
 void printevlist(void)
 {
   struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  int i;
+  printf("--------------\nEvent List Follows (in heap order):\n");
+  for(i = 0; i < evcount; i++) {
+    q = evheap[i];
+    printf("Event time: %f, type: %d entity: %d flow: %d\n",q->evtime,q->evtype,q->eventity,q->flow);
   }
   printf("--------------\n");
 }
 
-void init(void)                         /* initialize the simulator */
+void readinputs(void)                   /* ask for the settings of the runs */
 {
-  float sum, avg;
-  int i;
-
   printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
   printf("Enter the number of messages to simulate: ");
   scanf("%d",&nsimmax);
@@ -195,9 +666,38 @@ void init(void)                         /* initialize the simulator */
   scanf("%f",&lambda);
   printf("Enter TRACE:");
   scanf("%d",&TRACE);
+}
+
+/* start a run with the nodes of the path empty */
+static void inithop(struct hop *h)
+{
+  int i;
+
+  for (i=0; i<2; i++) {
+    h->busyuntil[i] = 0.0;
+    h->first[i] = 0;
+    h->count[i] = 0;
+    h->arrived[i] = 0;
+    h->lost[i] = 0;
+    h->dropped[i] = 0;
+    h->maxqueue[i] = 0;
+    h->busy[i] = 0.0;
+    h->qdelaysum[i] = 0.0;
+    h->departs[i] = malloc(h->qlimit * sizeof(float));
+    if (h->departs[i] == NULL) {
+      printf("memory allocation for the path's queues failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
 
+void init(void)                         /* initialize the simulator */
+{
+  float sum, avg;
+  int i;
 
-  srand(9999);              /* init random number generator */
+  PROF_RESET();
+  initstate(9999, (char *)rngstate, sizeof rngstate);  /* init random number generator */
   sum = 0.0;                /* test random number generator for students */
   for (i=0; i<1000; i++)
     sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -208,8 +708,17 @@ void init(void)                         /* initialize the simulator */
     printf("a look at the routine jimsrand() in the emulator code. Sorry. \n");
     exit(EXIT_FAILURE);
   }
+  for (i=0; i<2; i++) {     /* A's and B's own streams, for -p */
+    lps[i].stream[0] = 0x330E;
+    lps[i].stream[1] = 9999;
+    lps[i].stream[2] = i;
+    lps[i].stopat = -1.0;
+  }
 
   /* initialise statistics */
+  nsim = 0;
+  stopat = -1.0;
+  evinserted = 0;
   window_full = 0;
   total_ACKs_received = 0;
   packets_resent = 0;
@@ -219,14 +728,65 @@ void init(void)                         /* initialize the simulator */
   packets_corrupt = 0;
   packets_sent = 0;
   packets_timeout = 0;
+  nacks_sent = 0;
+  nack_resends = 0;
+  parity_sent = 0;
+  fec_recovered = 0;
+  probes_sent = 0;
   messages_delivered = 0;
+  bytes_delivered = 0;
+  latency_sum = 0.0;
+  latency_max = 0.0;
+
+  for (i=0; i<2; i++) {
+    bytes_tolayer3[i] = 0;
+    ntolayer3[i] = 0;
+    nlost[i] = 0;
+    ncorrupt[i] = 0;
+    narrived[i] = 0;
+    nqdropped[i] = 0;
+    qdelaysum[i] = 0.0;
+    qdelaymax[i] = 0.0;
+    queuedfirst[i] = 0;
+    queuedcount[i] = 0;
+    if (qlimit > 0 && (queued[i] = malloc(qlimit * sizeof(float))) == NULL) {
+      printf("memory allocation for the link's queue failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i=0; i<nhops; i++)
+    inithop(&hops[i]);
 
-  ntolayer3 = 0;
-  nlost = 0;
-  ncorrupt = 0;
+  flowstats = calloc(nflows, sizeof(struct flowstat));
+  timers = calloc(2 * nflows, sizeof(struct event *));
+  onend = calloc(nflows, sizeof(double));
+  if (flowstats == 0 || timers == 0 || onend == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  if (pacing) {
+    pacers = calloc(nflows, sizeof(struct pacer));
+    if (pacers == 0) {
+      printf("memory allocation for pacers failed.");
+      exit(EXIT_FAILURE);
+    }
+    paceinterval = proto->rtt / (PACEGAIN * window);
+    pacedsum = 0.0;
+  }
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  simtime=0.0;                 /* initialize time to 0.0 */
+  lastarrival[A] = 0.0;
+  lastarrival[B] = 0.0;
+  if (generator == ONOFF)
+    for (i=0; i<nflows; i++)    /* every flow starts in an on period */
+      onend[i] = expgap(onmean);
+  if (snapin != NULL)           /* a snapshot brings its own events */
+    return;
+  if (generator == TRACE5)      /* one chain, in trace order, for all flows */
+    generate_next_arrival(0);
+  else
+    for (i=0; i<nflows; i++)
+      generate_next_arrival(i);  /* initialize event list */
 }
 
 /********************** Student-callable ROUTINES ***********************/
@@ -234,50 +794,51 @@ void init(void)                         /* initialize the simulator */
 /* called by students routine to cancel a previously-started timer */
 void stoptimer(int AorB)
 /* A or B is trying to stop timer */
+{
+  stoptimer_flow(AorB, 0);
+}
+
+void stoptimer_flow(int AorB, int flow)
+/* A or B is trying to stop the timer of a flow */
 {
   struct event *q;
+  PROF_BEGIN(m);
 
   if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    printf("          STOP TIMER: stopping timer at %f\n",simtime);
+  q = timers[AorB*nflows + flow];
+  if (q != NULL) {
+    /* remove this event */
+    removeevent(q->heapidx);
+    timers[AorB*nflows + flow] = NULL;
+    free(q);
+  }
+  else
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+  PROF_END(PROF_STOP, m);
 }
 
 
 void starttimer(int AorB, double increment)
 /* A or B is trying to start timer */
 {
+  starttimer_flow(AorB, 0, increment);
+}
 
-  struct event *q;
+void starttimer_flow(int AorB, int flow, double increment)
+/* A or B is trying to start the timer of a flow */
+{
   struct event *evptr;
+  PROF_BEGIN(m);
 
   if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+    printf("          START TIMER: starting timer at %f\n",simtime);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (timers[AorB*nflows + flow] != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    PROF_END(PROF_START, m);
+    return;
+  }
  
   /* create future event for when timer goes off */
   evptr = malloc(sizeof(struct event));
@@ -285,12 +846,15 @@ void starttimer(int AorB, double increment)
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
-  evptr->evtime =  time + increment;
+  evptr->evtime =  simtime + increment;
   evptr->evtype =  TIMER_INTERRUPT;
    
  
   evptr->eventity = AorB;
+  evptr->flow = flow;
+  timers[AorB*nflows + flow] = evptr;
   insertevent(evptr);
+  PROF_END(PROF_START, m);
 } 
 
 
@@ -298,68 +862,117 @@ void starttimer(int AorB, double increment)
 void tolayer3(int AorB, struct pkt packet)
 /* A or B is sending to network  */
 {
-  struct pkt *mypktptr;
-  struct event *evptr,*q;
+  tolayer3_ref(AorB, &packet);
+}
+
+/* follow the window B advertises on a flow, for the time it is shut (-B) */
+static void watchwindow(struct flowstat *fs, const struct pkt *packet)
+{
+  int window;
+
+  memcpy(&window, packet->payload, sizeof window);
+  if (window == 0 && !fs->shut) {
+    fs->shut = 1;
+    fs->shutsince = simtime;
+  }
+  else if (window > 0 && fs->shut) {
+    fs->shut = 0;
+    fs->shuttime += simtime - fs->shutsince;
+  }
+}
+
+/* put a packet, already copied into its arrival event, into the medium */
+static void tomedium(int AorB, struct event *evptr)
+{
+  struct pkt *mypktptr = evptr->pktptr;
   float lastime, x;
-  int i;
+  int i, to = (AorB+1) % 2;
 
-  ntolayer3++;
+  ntolayer3[AorB]++;
+  bytes_tolayer3[AorB] += PKTHEADER + mypktptr->length;
+  if (AorB == A)
+    flowstats[mypktptr->flow].sent++;
+  else if (rcvbuf > 0 && (mypktptr->flags & PKT_RWND))
+    watchwindow(&flowstats[mypktptr->flow], mypktptr);
 
   /* simulate losses: */
   if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    nlost++;
+    nlost[AorB]++;
     if (TRACE>0)    
       printf("          TOLAYER3: packet being lost\n");
+    free(evptr);
     return;
   }  
 
-  /* make a copy of the packet student just gave me since he/she may decide */
-  /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
+  /* and a full queue */
+  if (qlimit > 0) {
+    while (queuedcount[to] > 0 && queued[to][queuedfirst[to]] <= simtime) {
+      queuedfirst[to] = (queuedfirst[to] + 1) % qlimit;
+      queuedcount[to]--;
+    }
+    if (queuedcount[to] == qlimit) {
+      nlost[AorB]++;
+      nqdropped[AorB]++;
+      if (TRACE>0)
+        printf("          TOLAYER3: queue full, packet dropped\n");
+      free(evptr);
+      return;
+    }
   }
-  mypktptr->seqnum = packet.seqnum;
-  mypktptr->acknum = packet.acknum;
-  mypktptr->checksum = packet.checksum;
-  for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
+
   if (TRACE>2)  {
     printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
            mypktptr->acknum,  mypktptr->checksum);
-    for (i=0; i<20; i++)
+    for (i=0; i<mypktptr->length; i++)
       printf("%c",mypktptr->payload[i]);
     printf("\n");
   }
 
   /* create future event for arrival of packet at the other side */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+  if (nhops > 0) {
+    evptr->evtype = HOP;          /* or at the first node on the path */
+    evptr->hop = 0;
+  }
+  evptr->eventity = to;           /* event occurs at other entity */
+  evptr->flow = mypktptr->flow;
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
      currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
+  lastime = simtime;
+  if (lastarrival[evptr->eventity] > lastime)
+    lastime = lastarrival[evptr->eventity];
+  qdelaysum[AorB] += lastime - simtime;
+  if (lastime - simtime > qdelaymax[AorB])
+    qdelaymax[AorB] = lastime - simtime;
   evptr->evtime =  lastime + 1 + 9*jimsrand();
+  /* the logical processes count on a packet arriving at least one time
+     unit after it was sent.  Past 2^24 a float is too coarse to hold
+     lastime + 1 and may round it down, so round up instead */
+  if (partitioned)
+    while (evptr->evtime < (double)simtime + 1)
+      evptr->evtime *= 1 + FLT_EPSILON;
+  lastarrival[evptr->eventity] = evptr->evtime;
+  if (qlimit > 0) {
+    queued[to][(queuedfirst[to] + queuedcount[to]) % qlimit] = evptr->evtime;
+    queuedcount[to]++;
+  }
  
 
 
   /* simulate corruption: */
   if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-      mypktptr->payload[0]='Z';   /* corrupt payload */
+    ncorrupt[AorB]++;
+    if ( (x = jimsrand()) < .75) {
+      if (mypktptr->length > 0)
+        mypktptr->payload[0]='Z';   /* corrupt payload */
+      else
+        /* an ACK has no payload now.  Spoil its checksum, so that only
+           the check sees the damage, as with the 'Z' in the 20 byte
+           dummy payload ACKs used to carry */
+        mypktptr->checksum ^= 0x5a;
+    }
     else if (x < .875)
       mypktptr->seqnum = 999999;
     else
@@ -373,106 +986,1826 @@ void tolayer3(int AorB, struct pkt packet)
   insertevent(evptr);
 } 
 
-void tolayer5(int AorB, char datasent[20])
+/* a packet reaches the next node on its path: lose it, drop it at a full
+   queue, or queue it and move its event on to where it comes out */
+static void forward(struct event *evptr)
 {
-  int i;  
-  if (TRACE>2) {
-    printf("          TOLAYER5: data received by application at ");
-    if (AorB == A) 
-      printf("A: ");
-    else
-      printf("B: ");
-    for (i=0; i<20; i++)  
-      printf("%c",datasent[i]);
-    printf("\n");
+  int to = evptr->eventity, from = (to+1) % 2;
+  struct hop *h = &hops[to == B ? evptr->hop : nhops - 1 - evptr->hop];
+  float start, tx;
+
+  h->arrived[to]++;
+  if (jimsrand() < h->loss) {
+    nlost[from]++;
+    h->lost[to]++;
+    if (TRACE>0)
+      printf("          HOP: packet being lost at node %d\n", (int)(h - hops) + 1);
+    free(evptr);
+    return;
   }
-  messages_delivered++;
+  while (h->count[to] > 0 && h->departs[to][h->first[to]] <= simtime) {
+    h->first[to] = (h->first[to] + 1) % h->qlimit;
+    h->count[to]--;
+  }
+  if (h->count[to] == h->qlimit) {
+    nlost[from]++;
+    nqdropped[from]++;
+    h->dropped[to]++;
+    if (TRACE>0)
+      printf("          HOP: queue full at node %d, packet dropped\n", (int)(h - hops) + 1);
+    free(evptr);
+    return;
+  }
+
+  start = simtime;
+  if (h->busyuntil[to] > start)
+    start = h->busyuntil[to];
+  tx = (PKTHEADER + evptr->pktptr->length) / h->rate;
+  h->qdelaysum[to] += start - simtime;
+  h->busy[to] += tx;
+  h->busyuntil[to] = start + tx;
+  h->departs[to][(h->first[to] + h->count[to]) % h->qlimit] = start + tx;
+  if (++h->count[to] > h->maxqueue[to])
+    h->maxqueue[to] = h->count[to];
+
+  evptr->evtime = start + tx + h->delay;
+  if (++evptr->hop == nhops)
+    evptr->evtype = FROM_LAYER3;  /* the last link ends at the receiver */
+  insertevent(evptr);
 }
 
-int main(void)
+/* have a PACE event let the flow's next held packet go at its time */
+static void schedulepace(int flow)
 {
-  struct event *eventptr;
-  struct msg  msg2give;
-  struct pkt  pkt2give;
-   
-  int i,j;
-  
-  init();
-  A_init();
-  B_init();
-   
-  while (1) {
-    eventptr = evlist;            /* get next event to simulate */
-    if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
-      if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
-      else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
-      else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
-    }
-    time = eventptr->evtime;        /* update time to next event time */
-    if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
-        /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
-        for (i=0; i<20; i++)  
-          msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
-          printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
-          printf("\n");
-        }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
-        else
-          B_output(msg2give);  
-      }
-      else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
-    }
-    else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
-      else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
+  struct event *evptr;
+
+  evptr = malloc(sizeof(struct event));
+  if (evptr == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  evptr->evtime = pacers[flow].next;
+  evptr->evtype = PACE;
+  evptr->eventity = A;
+  evptr->flow = flow;
+  insertevent(evptr);
+}
+
+/* send one of A's packets now if its flow's pacer allows, else hold it */
+static void pace(struct event *evptr)
+{
+  struct pacer *p = &pacers[evptr->pktptr->flow];
+  struct event **waiting;
+  int i;
+
+  if (p->count == 0 && simtime >= p->next) {
+    p->next = simtime + paceinterval;
+    tomedium(A, evptr);
+    return;
+  }
+  if (p->count == p->size) {
+    waiting = malloc((p->size ? 2 * p->size : 8) * sizeof(struct event *));
+    if (waiting == 0) {
+      printf("memory allocation for pacer failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
-      else
-        B_timerinterrupt();
+    for (i=0; i<p->count; i++)
+      waiting[i] = p->waiting[(p->first + i) % p->size];
+    free(p->waiting);
+    p->waiting = waiting;
+    p->first = 0;
+    p->size = p->size ? 2 * p->size : 8;
+  }
+  evptr->evtime = simtime;        /* held since */
+  p->waiting[(p->first + p->count) % p->size] = evptr;
+  if (p->count++ == 0)
+    schedulepace(evptr->pktptr->flow);
+}
+
+/* let the flow's oldest held packet go, on its PACE event */
+static void releasepaced(int flow)
+{
+  struct pacer *p = &pacers[flow];
+  struct event *evptr = p->waiting[p->first];
+
+  p->first = (p->first + 1) % p->size;
+  p->count--;
+  p->next = simtime + paceinterval;
+  pacedsum += simtime - evptr->evtime;
+  tomedium(A, evptr);
+  if (p->count > 0)
+    schedulepace(flow);
+}
+
+/* an event with room after it for a packet of length payload bytes */
+static struct event *eventwithpkt(int length)
+{
+  struct event *evptr;
+
+  evptr = malloc(sizeof(struct event) + PKTSIZE(length));
+  if (evptr == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  evptr->pktptr = (struct pkt *)(evptr + 1);
+  return evptr;
+}
+
+void tolayer3_ref(int AorB, const struct pkt *packet)
+/* A or B is sending to network, packet is only read */
+{
+  struct event *evptr;
+  PROF_BEGIN(m);
+
+  /* make a copy of the packet student just gave me since he/she may decide */
+  /* to do something with the packet after we return back to him/her. */
+  /* The copy lives with the arrival event, so one allocation does both */
+  evptr = eventwithpkt(packet->length);
+  memcpy(evptr->pktptr, packet, PKTHEADER + packet->length);  /* unused payload is not copied */
+  if (pacers != NULL && AorB == A)
+    pace(evptr);
+  else
+    tomedium(AorB, evptr);
+  PROF_END(PROF_TOLAYER3, m);
+}
+
+/* Steady-state estimation (-c).  Deliveries at B are taken five at a time.
+   MSER-5 picks how many of these groups at the start belong to the warm-up:
+   the cut, within the first half of the run, that leaves the smallest
+   standard error of the mean of the rest.  What is left is split into
+   SSBATCHES batch means of latency and of goodput, and once the 95%
+   confidence half-widths of both are within the target fraction of their
+   means no more messages are generated and the run drains.  The decision
+   is made at B and takes effect at A one time unit later, the least time
+   a packet needs, so -p 2 stops at the same point as -p 1 */
+#define SSGROUP     5       /* deliveries per MSER-5 observation */
+#define SSBATCHES   20      /* batch means behind each confidence interval */
+#define SSMINBATCH  10      /* fewest groups in a batch */
+#define SST         2.093   /* 97.5% point of Student's t, SSBATCHES-1 degrees of freedom */
+
+struct ssgroup {
+  double delay;             /* summed delays of the group's messages */
+  double bytes;             /* summed bytes of the group's messages */
+  double span;              /* time from the delivery before the group to its last */
+};
+
+static double sstarget = 0.0;       /* relative half-width to stop at (-c), 0 for none */
+static struct ssgroup *ssgroups;    /* completed groups */
+static int ssngroups, sssize;
+static struct ssgroup sscur;        /* the group being filled */
+static int sscurn;
+static float sslast;                /* time of the last delivery */
+static int ssnextcheck = 2*SSBATCHES*SSMINBATCH;
+static int sswarmup;                /* groups cut as warm-up at the last estimate */
+static double ssmean[2], sshalf[2]; /* latency and goodput at the last estimate */
+static int ssdone;                  /* messages delivered when the target was met */
+static float ssdonetime;
+
+/* square root by Newton's method, so that the emulator needs no -lm */
+static double sssqrt(double x)
+{
+  double r = x > 1.0 ? x : 1.0;
+  int i;
+
+  if (x <= 0.0)
+    return 0.0;
+  for (i=0; i<64 && r*r - x > 1e-12*x; i++)
+    r = (r + x/r) / 2;
+  return r;
+}
+
+/* group g as an observation of latency (which 0) or goodput (which 1) */
+static double ssvalue(int which, const struct ssgroup *g)
+{
+  if (which == 0)
+    return g->delay / SSGROUP;
+  return g->span > 0.0 ? g->bytes / g->span : 0.0;
+}
+
+/* MSER: the number of leading groups whose removal leaves the smallest
+   standard error of the mean of the rest */
+static int ssmser(int which)
+{
+  double s1 = 0.0, s2 = 0.0, x, n, mser, best = -1.0;
+  int d, cut = 0;
+
+  for (d=0; d<ssngroups; d++) {
+    x = ssvalue(which, &ssgroups[d]);
+    s1 += x;
+    s2 += x*x;
+  }
+  for (d=0; d<=ssngroups/2; d++) {
+    n = ssngroups - d;
+    mser = (s2 - s1*s1/n) / (n*n);
+    if (best < 0.0 || mser < best) {
+      best = mser;
+      cut = d;
     }
-    else  {
-      printf("INTERNAL PANIC: unknown event type \n");
+    x = ssvalue(which, &ssgroups[d]);
+    s1 -= x;
+    s2 -= x*x;
+  }
+  return cut;
+}
+
+/* mean and 95% half-width from SSBATCHES batch means over the latest
+   groups after the warm-up.  A batch's goodput is its bytes over its time */
+static void ssbatchmeans(int which, double *mean, double *half)
+{
+  int size = (ssngroups - sswarmup) / SSBATCHES;
+  int first = ssngroups - size*SSBATCHES;
+  double num, den, x, sum = 0.0, sumsq = 0.0, var;
+  struct ssgroup *g;
+  int b, j;
+
+  for (b=0; b<SSBATCHES; b++) {
+    num = den = 0.0;
+    for (j=0; j<size; j++) {
+      g = &ssgroups[first + b*size + j];
+      num += which == 0 ? g->delay : g->bytes;
+      den += which == 0 ? SSGROUP : g->span;
     }
-    free(eventptr);
+    x = den > 0.0 ? num / den : 0.0;
+    sum += x;
+    sumsq += x*x;
   }
+  *mean = sum / SSBATCHES;
+  var = (sumsq - sum*sum/SSBATCHES) / (SSBATCHES - 1);
+  *half = SST * sssqrt(var / SSBATCHES);
+}
 
- terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
-  printf("number of messages dropped due to full window:  %d \n", window_full);
-  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
-  printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
+/* redo the warm-up cut and both estimates; 1 if there are enough groups */
+static int ssestimate(void)
+{
+  int cut;
+
+  sswarmup = ssmser(0);
+  cut = ssmser(1);
+  if (cut > sswarmup)
+    sswarmup = cut;
+  if ((ssngroups - sswarmup) / SSBATCHES < SSMINBATCH)
+    return 0;
+  ssbatchmeans(0, &ssmean[0], &sshalf[0]);
+  ssbatchmeans(1, &ssmean[1], &sshalf[1]);
+  return 1;
+}
+
+/* a message of length bytes reached B after delay */
+static void ssobserve(float delay, int length)
+{
+  if (ssdone)
+    return;
+  sscur.delay += delay;
+  sscur.bytes += length;
+  sscur.span += simtime - sslast;
+  sslast = simtime;
+  if (++sscurn < SSGROUP)
+    return;
+  if (ssngroups == sssize) {
+    sssize = sssize ? 2*sssize : 1024;
+    ssgroups = realloc(ssgroups, sssize * sizeof(struct ssgroup));
+    if (ssgroups == 0) {
+      printf("memory allocation for steady-state statistics failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  ssgroups[ssngroups++] = sscur;
+  memset(&sscur, 0, sizeof sscur);
+  sscurn = 0;
+
+  /* the cut is O(groups), so look again only after a tenth more of them */
+  if (ssngroups < ssnextcheck)
+    return;
+  ssnextcheck = ssngroups + (ssngroups/10 > SSBATCHES ? ssngroups/10 : SSBATCHES);
+  if (ssestimate() && sshalf[0] <= sstarget*ssmean[0] && sshalf[1] <= sstarget*ssmean[1]) {
+    ssdone = ssngroups * SSGROUP;
+    ssdonetime = simtime;
+    lps[B].stopat = simtime + 1;
+    if (partitioned < 2)
+      stopat = lps[B].stopat;
+  }
+}
+
+/* forget what the last run delivered, before the next one */
+static void ssreset(void)
+{
+  ssngroups = 0;
+  memset(&sscur, 0, sizeof sscur);
+  sscurn = 0;
+  sslast = 0.0;
+  ssnextcheck = 2*SSBATCHES*SSMINBATCH;
+  sswarmup = 0;
+  ssdone = 0;
+  ssdonetime = 0.0;
+}
+
+static void printsteady(void)
+{
+  if (!ssdone && !ssestimate()) {
+    printf("steady state: too few messages (%d) for %d batch means after the warm-up\n",
+           ssngroups * SSGROUP, SSBATCHES);
+    return;
+  }
+  printf("steady state (MSER-5 warm-up, %d batch means, 95%% confidence):\n", SSBATCHES);
+  printf("  warm-up discarded:  %d messages\n", sswarmup * SSGROUP);
+  printf("  message delay:  %f +- %f (%.2f%%)\n", ssmean[0], sshalf[0],
+         ssmean[0] > 0.0 ? 100.0 * sshalf[0] / ssmean[0] : 0.0);
+  printf("  goodput:  %.4f +- %.4f bytes per time unit (%.2f%%)\n", ssmean[1], sshalf[1],
+         ssmean[1] > 0.0 ? 100.0 * sshalf[1] / ssmean[1] : 0.0);
+  if (ssdone)
+    printf("  target of %.2f%% met after %d messages delivered, at time %f\n",
+           100.0 * sstarget, ssdone, ssdonetime);
+  else
+    printf("  target of %.2f%% not met after %d messages delivered\n",
+           100.0 * sstarget, ssngroups * SSGROUP);
+}
+
+void tolayer5(int AorB, const char datasent[20])
+{
+  tolayer5_bytes(AorB, 0, datasent, 20);
+}
+
+/* let B's layer 5 take out of a flow's buffer what it could have since the
+   last look, at drainrate, and add the time since to its statistics */
+static void drainbuffer(struct flowstat *fs)
+{
+  double dt = simtime - fs->drained, b = fs->buffered, t;
+
+  if (dt <= 0.0)
+    return;
+  t = b / drainrate;          /* until it is empty */
+  if (t >= dt) {
+    fs->bufferarea += dt * (b - drainrate * dt / 2);
+    fs->buffered = b - drainrate * dt;
+  }
+  else {
+    fs->bufferarea += t * b / 2;
+    fs->buffered = 0.0;
+  }
+  fs->drained = simtime;
+}
+
+/* bytes B's layer 5 buffer for the flow can take now */
+int layer5_room(int flow)
+{
+  drainbuffer(&flowstats[flow]);
+  return (int)(rcvbuf - flowstats[flow].buffered);
+}
+
+void tolayer5_bytes(int AorB, int flow, const char *datasent, int length)
+{
+  struct flowstat *fs;
+  float delay;
+  int i;  
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at ");
+    if (AorB == A) 
+      printf("A: ");
+    else
+      printf("B: ");
+    for (i=0; i<length; i++)  
+      printf("%c",datasent[i]);
+    printf("\n");
+  }
+  messages_delivered++;
+  bytes_delivered += length;
+  flowstats[flow].delivered++;
+  flowstats[flow].bytes += length;
+  if (rcvbuf > 0 && AorB == B) {
+    fs = &flowstats[flow];
+    drainbuffer(fs);
+    fs->buffered += length;
+    if (fs->buffered > fs->buffermax)
+      fs->buffermax = fs->buffered;
+  }
+
+  /* each flow delivers in order, so this is the oldest accepted message */
+  fs = &flowstats[flow];
+  if (AorB == B && fs->acceptcount > 0) {
+    delay = simtime - fs->accepttimes[fs->acceptfirst];
+    fs->acceptfirst = (fs->acceptfirst + 1) % fs->acceptsize;
+    fs->acceptcount--;
+    latency_sum += delay;
+    if (delay > latency_max)
+      latency_max = delay;
+    if (sstarget > 0.0)
+      ssobserve(delay, length);
+  }
+}
+
+/* remember when a flow's message was accepted by A, to time its delivery */
+static void recordaccept(struct flowstat *fs, float when)
+{
+  float *grown;
+  int i;
+
+  if (fs->acceptcount == fs->acceptsize) {
+    grown = malloc((fs->acceptsize ? 2*fs->acceptsize : 16) * sizeof(float));
+    if (grown == 0) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<fs->acceptcount; i++)
+      grown[i] = fs->accepttimes[(fs->acceptfirst + i) % fs->acceptsize];
+    free(fs->accepttimes);
+    fs->accepttimes = grown;
+    fs->acceptfirst = 0;
+    fs->acceptsize = fs->acceptsize ? 2*fs->acceptsize : 16;
+  }
+  fs->accepttimes[(fs->acceptfirst + fs->acceptcount) % fs->acceptsize] = when;
+  fs->acceptcount++;
+}
+
+/* with -p 2, B takes accept times out of the flows' rings while A runs, so
+   A keeps the ones of the current window aside until both have stopped.
+   The message cannot reach B before the next window */
+static void stageaccept(int flow)
+{
+  struct lp *lp = &lps[A];
+
+  if (lp->acceptcount == lp->acceptsize) {
+    lp->acceptsize = lp->acceptsize ? 2*lp->acceptsize : 64;
+    lp->accepttimes = realloc(lp->accepttimes, lp->acceptsize * sizeof(float));
+    lp->acceptflows = realloc(lp->acceptflows, lp->acceptsize * sizeof(int));
+    if (lp->accepttimes == 0 || lp->acceptflows == 0) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  lp->accepttimes[lp->acceptcount] = simtime;
+  lp->acceptflows[lp->acceptcount++] = flow;
+}
+
+static void flushaccepts(void)
+{
+  struct lp *lp = &lps[A];
+  int i;
+
+  for (i=0; i<lp->acceptcount; i++)
+    recordaccept(&flowstats[lp->acceptflows[i]], lp->accepttimes[i]);
+  lp->acceptcount = 0;
+}
+
+/* Snapshots (-S, -R).  A snapshot is a flat file with no pointers in it:
+   a header with the settings, clock, random number state and statistics,
+   then each flow's statistics and undelivered accept times, then the
+   pending events oldest first, each followed by its packet if it carries
+   one, and last whatever A and B of the protocol write in A_save() and
+   B_save().  A
+   restore maps the file and reads it straight out of memory, so starting
+   many what-if runs from the end of one long warm-up costs a read of a
+   file the size of the state in flight, not a rerun of the warm-up */
+#define SNAPMAGIC "EMUSNAP3"
+
+struct snaphead {
+  char magic[8];
+  int pktsize;                    /* sizeof(struct pkt) of the program that wrote it */
+  int mtu, nflows, msgsize, partitioned;
+  char protocol[8];               /* the protocol's name and window */
+  int window;
+  int nevents;
+  int nsim;
+  float simtime;
+  float lastarrival[2];
+  unsigned int rngstate[32];
+  unsigned short stream[2][3];
+  int window_full, total_ACKs_received, packets_resent, new_ACKs, packets_received;
+  int messages_delivered;
+  long bytes_tolayer3[2], bytes_delivered;
+  double latency_sum;
+  float latency_max;
+  int ntolayer3[2], nlost[2], ncorrupt[2], narrived[2];
+  int packets_timeout;
+};
+
+struct snapevent {
+  float evtime, created;
+  int evtype, eventity, flow, creator;
+};
+
+static const char *snapcursor;    /* next byte to read from the mapped snapshot */
+static const char *snapend;
+static FILE *snapfp;
+
+static void snapput(const void *p, int n)
+{
+  if (n > 0 && fwrite(p, 1, n, snapfp) != (size_t)n) {
+    printf("could not write snapshot %s.\n", snapout);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void snapget(void *p, int n)
+{
+  if (n > snapend - snapcursor) {
+    printf("snapshot %s is truncated.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(p, snapcursor, n);
+  snapcursor += n;
+}
+
+static int evolder(const void *p, const void *q)
+{
+  const struct event *a = *(struct event *const *)p, *b = *(struct event *const *)q;
+
+  return a->evseq < b->evseq ? -1 : a->evseq > b->evseq;
+}
+
+/* write everything needed to carry on from here to snapout */
+static void savesnapshot(void)
+{
+  struct snaphead h;
+  struct snapevent se;
+  struct flowstat *fs;
+  struct event **evs;
+  int i, k;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, SNAPMAGIC, sizeof h.magic);
+  h.pktsize = sizeof(struct pkt);
+  h.mtu = mtu;
+  h.nflows = nflows;
+  h.msgsize = msgsize;
+  h.partitioned = partitioned;
+  strncpy(h.protocol, proto->name, sizeof h.protocol - 1);
+  h.window = window;
+  h.nevents = evcount;
+  h.nsim = nsim;
+  h.simtime = simtime;
+  h.lastarrival[A] = lastarrival[A];
+  h.lastarrival[B] = lastarrival[B];
+  setstate((char *)rngstate);   /* has random() write its position into the array */
+  memcpy(h.rngstate, rngstate, sizeof rngstate);
+  for (i=0; i<2; i++) {
+    memcpy(h.stream[i], lps[i].stream, sizeof h.stream[i]);
+    h.bytes_tolayer3[i] = bytes_tolayer3[i];
+    h.ntolayer3[i] = ntolayer3[i];
+    h.nlost[i] = nlost[i];
+    h.ncorrupt[i] = ncorrupt[i];
+    h.narrived[i] = narrived[i];
+  }
+  h.window_full = window_full;
+  h.total_ACKs_received = total_ACKs_received;
+  h.packets_resent = packets_resent;
+  h.new_ACKs = new_ACKs;
+  h.packets_received = packets_received;
+  h.packets_timeout = packets_timeout;
+  h.messages_delivered = messages_delivered;
+  h.bytes_delivered = bytes_delivered;
+  h.latency_sum = latency_sum;
+  h.latency_max = latency_max;
+
+  snapfp = fopen(snapout, "wb");
+  if (snapfp == NULL) {
+    printf("could not create snapshot %s.\n", snapout);
+    exit(EXIT_FAILURE);
+  }
+  snapput(&h, sizeof h);
+  for (i=0; i<nflows; i++) {
+    fs = &flowstats[i];
+    snapput(fs, sizeof(struct flowstat));
+    for (k=0; k<fs->acceptcount; k++)
+      snapput(&fs->accepttimes[(fs->acceptfirst + k) % fs->acceptsize], sizeof(float));
+  }
+
+  /* oldest first, so that putting them back in order keeps their ties */
+  evs = malloc((evcount ? evcount : 1) * sizeof(struct event *));
+  if (evs == 0) {
+    printf("memory allocation for snapshot failed.");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(evs, evheap, evcount * sizeof(struct event *));
+  qsort(evs, evcount, sizeof(struct event *), evolder);
+  for (i=0; i<evcount; i++) {
+    se.evtime = evs[i]->evtime;
+    se.created = evs[i]->created;
+    se.evtype = evs[i]->evtype;
+    se.eventity = evs[i]->eventity;
+    se.flow = evs[i]->flow;
+    se.creator = evs[i]->creator;
+    snapput(&se, sizeof se);
+    if (se.evtype == FROM_LAYER3)
+      snapput(evs[i]->pktptr, PKTHEADER + evs[i]->pktptr->length);
+  }
+  free(evs);
+
+  proto->A_save(pstate, snapput);
+  proto->B_save(pstate, snapput);
+  if (fclose(snapfp) != 0) {
+    printf("could not write snapshot %s.\n", snapout);
+    exit(EXIT_FAILURE);
+  }
+  printf("snapshot of time %f saved to %s\n", simtime, snapout);
+}
+
+/* map snapin and take the settings it was made with.  Runs before init(),
+   which sizes everything from them */
+static void opensnapshot(void)
+{
+  struct snaphead h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(snapin, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("could not open snapshot %s.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("could not map snapshot %s.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  snapcursor = map;
+  snapend = snapcursor + st.st_size;
+  memcpy(&h, snapcursor, sizeof h < (size_t)st.st_size ? sizeof h : (size_t)st.st_size);
+  if (st.st_size < (off_t)sizeof h || memcmp(h.magic, SNAPMAGIC, sizeof h.magic) != 0
+      || h.pktsize != sizeof(struct pkt)) {
+    printf("%s is not a snapshot this program can read.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  /* -p 2 runs the same model as -p 1, anything else has to match */
+  if ((partitioned == 0) != (h.partitioned == 0)) {
+    printf("snapshot %s was made %s -p.\n", snapin, h.partitioned ? "with" : "without");
+    exit(EXIT_FAILURE);
+  }
+  h.protocol[sizeof h.protocol - 1] = '\0';
+  runs[0].proto = findprotocol(h.protocol);
+  if (runs[0].proto == NULL || h.window < 1 || h.window > runs[0].proto->maxwindow) {
+    printf("snapshot %s was made with a protocol this program does not have.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  runs[0].window = h.window;
+  if (h.mtu < 1 || h.mtu > MAXPAYLOAD || h.nflows < 1 || h.msgsize < 0 || h.msgsize > MAXMSGSIZE
+      || h.nevents < 0) {
+    printf("snapshot %s is corrupt.\n", snapin);
+    exit(EXIT_FAILURE);
+  }
+  mtu = h.mtu;
+  nflows = h.nflows;
+  msgsize = h.msgsize;
+}
+
+/* read the rest of the snapshot into the emulator, A and B, once init()
+   and the protocol's create() have set everything up */
+static void restoresnapshot(void)
+{
+  const char *map = snapcursor;
+  size_t maplen = snapend - snapcursor;
+  struct snaphead h;
+  struct snapevent se;
+  struct flowstat *fs;
+  struct event *p;
+  struct pkt head;
+  float when;
+  int i, k, count;
+
+  snapget(&h, sizeof h);
+  nsim = h.nsim;
+  simtime = h.simtime;
+  lastarrival[A] = h.lastarrival[A];
+  lastarrival[B] = h.lastarrival[B];
+  /* setstate() first writes the position of the state it leaves into that
+     state's array, so leave rngstate before copying into it */
+  setstate((char *)h.rngstate);
+  memcpy(rngstate, h.rngstate, sizeof rngstate);
+  setstate((char *)rngstate);
+  for (i=0; i<2; i++) {
+    memcpy(lps[i].stream, h.stream[i], sizeof lps[i].stream);
+    bytes_tolayer3[i] = h.bytes_tolayer3[i];
+    ntolayer3[i] = h.ntolayer3[i];
+    nlost[i] = h.nlost[i];
+    ncorrupt[i] = h.ncorrupt[i];
+    narrived[i] = h.narrived[i];
+  }
+  window_full = h.window_full;
+  total_ACKs_received = h.total_ACKs_received;
+  packets_resent = h.packets_resent;
+  new_ACKs = h.new_ACKs;
+  packets_received = h.packets_received;
+  packets_timeout = h.packets_timeout;
+  messages_delivered = h.messages_delivered;
+  bytes_delivered = h.bytes_delivered;
+  latency_sum = h.latency_sum;
+  latency_max = h.latency_max;
+
+  for (i=0; i<nflows; i++) {
+    fs = &flowstats[i];
+    snapget(fs, sizeof(struct flowstat));
+    count = fs->acceptcount;
+    fs->accepttimes = NULL;     /* the snapshot's pointer is stale */
+    fs->acceptfirst = fs->acceptcount = fs->acceptsize = 0;
+    for (k=0; k<count; k++) {
+      snapget(&when, sizeof when);
+      recordaccept(fs, when);
+    }
+  }
+
+  for (i=0; i<h.nevents; i++) {
+    snapget(&se, sizeof se);
+    /* no PACE or HOP event is saved, see main() */
+    if ((se.evtype != TIMER_INTERRUPT && se.evtype != FROM_LAYER5 && se.evtype != FROM_LAYER3)
+        || (se.eventity != A && se.eventity != B) || se.flow < 0 || se.flow >= nflows) {
+      printf("snapshot %s is corrupt.\n", snapin);
+      exit(EXIT_FAILURE);
+    }
+    if (se.evtype == FROM_LAYER3) {
+      snapget(&head, PKTHEADER);
+      if (head.length < 0 || head.length > MAXPAYLOAD || head.flow != se.flow) {
+        printf("snapshot %s is corrupt.\n", snapin);
+        exit(EXIT_FAILURE);
+      }
+      p = eventwithpkt(head.length);
+      memcpy(p->pktptr, &head, PKTHEADER);
+      snapget(p->pktptr->payload, head.length);
+    }
+    else {
+      p = malloc(sizeof(struct event));
+      if (p == 0) {
+        printf("memory allocation for event failed.");
+        exit(EXIT_FAILURE);
+      }
+      p->pktptr = NULL;
+    }
+    p->evtime = se.evtime;
+    p->created = se.created;
+    p->evtype = se.evtype;
+    p->eventity = se.eventity;
+    p->flow = se.flow;
+    p->creator = se.creator;
+    if (se.evtype == TIMER_INTERRUPT)
+      timers[se.eventity*nflows + se.flow] = p;
+    /* with -p 2, B's events reach B's heap at the first window */
+    if (partitioned == 2 && p->eventity != A)
+      postevent(&lps[A], p);
+    else
+      heapinsert(p);
+  }
+
+  proto->A_restore(pstate, snapget);
+  proto->B_restore(pstate, snapget);
+  munmap((void *)map, maplen);
+}
+
+/* Time series (-t).  Every sampleint units of simulated time the sampler
+   records the state of the protocol and of the channel.  Nothing changes
+   between events, so the samples due before an event are taken just
+   before it is handled, and the event list is left alone.  Rows are kept
+   SAMPLEBLOCK at a time and written out column by column:
+     header:  "EMUSERS1", int ncols, then ncols names of 16 bytes each, the
+              last byte of which is the column's type, 'f' float or 'i' int
+     blocks:  int nrows, then for each column nrows 4-byte values
+   all in the byte order of the machine that wrote them */
+#define SAMPLEBLOCK 4096
+#define SAMPLECOLS  9
+
+static const char *samplenames[SAMPLECOLS] = {
+  "time", "window", "inflight_ab", "inflight_ba", "events",
+  "offered", "resends", "timeouts", "delivered"
+};
+
+static double sampleint;          /* time between samples (-t) */
+static char *sampleout;           /* file they go to */
+static FILE *samplefp;
+static long samplenext;           /* the next sample is due at samplenext*sampleint */
+static long samplestotal;
+static float sampletimes[SAMPLEBLOCK];
+static int samplecounts[SAMPLECOLS-1][SAMPLEBLOCK];
+static int nsamples;              /* rows in the block so far */
+
+static void samplewrite(const void *p, int n)
+{
+  if (fwrite(p, 1, n, samplefp) != (size_t)n) {
+    printf("could not write time series %s.\n", sampleout);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void opensamples(void)
+{
+  char name[16];
+  int i, ncols = SAMPLECOLS;
+
+  samplefp = fopen(sampleout, "wb");
+  if (samplefp == NULL) {
+    printf("could not create time series %s.\n", sampleout);
+    exit(EXIT_FAILURE);
+  }
+  samplewrite("EMUSERS1", 8);
+  samplewrite(&ncols, sizeof ncols);
+  for (i=0; i<SAMPLECOLS; i++) {
+    memset(name, 0, sizeof name);
+    strncpy(name, samplenames[i], sizeof name - 1);
+    name[sizeof name - 1] = i == 0 ? 'f' : 'i';
+    samplewrite(name, sizeof name);
+  }
+  /* the first sample is the first one due at or after the start */
+  samplenext = (long)(simtime / sampleint);
+  if (samplenext * sampleint < simtime)
+    samplenext++;
+}
+
+static void flushsamples(void)
+{
+  int i;
+
+  if (nsamples == 0)
+    return;
+  samplewrite(&nsamples, sizeof nsamples);
+  samplewrite(sampletimes, nsamples * sizeof(float));
+  for (i=0; i<SAMPLECOLS-1; i++)
+    samplewrite(samplecounts[i], nsamples * sizeof(int));
+  nsamples = 0;
+}
+
+/* take every sample due up to time until */
+static void takesamples(float until)
+{
+  int window, i;
+
+  while (samplenext * sampleint <= until) {
+    window = 0;
+    for (i=0; i<nflows; i++)
+      window += proto->A_windowcount(pstate, i);
+    sampletimes[nsamples] = samplenext * sampleint;
+    samplecounts[0][nsamples] = window;
+    samplecounts[1][nsamples] = ntolayer3[A] - nlost[A] - narrived[B];
+    samplecounts[2][nsamples] = ntolayer3[B] - nlost[B] - narrived[A];
+    samplecounts[3][nsamples] = evcount;
+    samplecounts[4][nsamples] = nsim;
+    samplecounts[5][nsamples] = packets_resent;
+    samplecounts[6][nsamples] = packets_timeout;
+    samplecounts[7][nsamples] = messages_delivered;
+    samplenext++;
+    samplestotal++;
+    if (++nsamples == SAMPLEBLOCK)
+      flushsamples();
+  }
+}
+
+static void closesamples(void)
+{
+  flushsamples();
+  if (fclose(samplefp) != 0) {
+    printf("could not write time series %s.\n", sampleout);
+    exit(EXIT_FAILURE);
+  }
+  printf("time series:  %ld samples every %g time units written to %s\n",
+         samplestotal, sampleint, sampleout);
+}
+
+/* per-flow results and Jain's fairness index over the flows' goodput,
+   (sum x)^2 / (n * sum x^2), which is 1 when every flow gets the same */
+static void printflows(void)
+{
+  double x, sum = 0.0, sumsq = 0.0, min = 0.0, max = 0.0;
+  int i;
+
+  printf("%d flows sharing the link\n", nflows);
+  if (nflows <= 64)
+    printf(" flow  offered accepted delivered      bytes     sent timeouts   goodput\n");
+  for (i=0; i<nflows; i++) {
+    x = simtime > 0.0 ? flowstats[i].bytes / simtime : 0.0;
+    if (nflows <= 64)
+      printf("%5d %8d %8d %9d %10ld %8d %8d %9.4f\n", i, flowstats[i].offered,
+             flowstats[i].accepted, flowstats[i].delivered, flowstats[i].bytes,
+             flowstats[i].sent, flowstats[i].timeouts, x);
+    sum += x;
+    sumsq += x * x;
+    if (i == 0 || x < min)
+      min = x;
+    if (i == 0 || x > max)
+      max = x;
+  }
+  printf("goodput per flow (bytes per time unit): min %.4f mean %.4f max %.4f\n",
+         min, sum / nflows, max);
+  if (sumsq > 0.0)
+    printf("Jain fairness index:  %.4f \n", sum * sum / (nflows * sumsq));
+}
+
+/* how full B's layer 5 buffers ran (-B), averaged over the flows */
+static void printbuffers(void)
+{
+  struct flowstat *fs;
+  double area = 0.0, shut = 0.0, max = 0.0;
+  int i;
+
+  for (i=0; i<nflows; i++) {
+    fs = &flowstats[i];
+    drainbuffer(fs);
+    area += fs->bufferarea;
+    shut += fs->shuttime + (fs->shut ? simtime - fs->shutsince : 0.0);
+    if (fs->buffermax > max)
+      max = fs->buffermax;
+  }
+  printf("B's layer 5 buffer:  %d bytes per flow, drained at %.2f bytes per time unit \n", rcvbuf, drainrate);
+  if (simtime > 0.0) {
+    printf("buffer occupancy per flow:  average %.1f, max %.0f bytes \n", area / nflows / simtime, max);
+    printf("time per flow B's window was shut (stalled):  %.1f (%.1f%% of the run) \n",
+           shut / nflows, 100.0 * shut / nflows / simtime);
+  }
+  printf("number of zero window probes sent by A:  %d \n", probes_sent);
+}
+
+/* 1 while layer 5 still has messages to give.  A backlog gives no more
+   after the time the uniform generator would have taken to offer them all,
+   nsimmax * lambda, so a protocol that only crawls still ends its run */
+static int moremessages(void)
+{
+  if (generator == BACKLOG && simtime >= nsimmax * lambda)
+    return 0;
+  return nsim < nsimmax && (stopat < 0.0 || simtime < stopat);
+}
+
+/* hand the next message from layer 5 to an entity */
+static void offermessage(int entity, int flow)
+{
+  struct msg  msg2give;
+  int i,j,accepted;
+
+  /* fill in msg to give with string of same letter */    
+  j = nsim % 26; 
+  memset(msgdata, 97 + j, msgsize);
+  if (TRACE>2) {
+    printf("          MAINLOOP: data given to student: ");
+    for (i=0; i<msgsize; i++) 
+      printf("%c", msgdata[i]);
+    printf("\n");
+  }
+  nsim++;
+  flowstats[flow].offered++;
+  if (entity == A) {
+    PROF_BEGIN(m);
+    accepted = proto->A_output_bytes(pstate, flow, msgdata, msgsize);
+    PROF_END(PROF_AOUTPUT, m);
+    if (accepted) {
+      flowstats[flow].accepted++;
+      if (partitioned == 2)
+        stageaccept(flow);
+      else
+        recordaccept(&flowstats[flow], simtime);
+    }
+  }
+  else {
+    memset(msg2give.data, 97 + j, 20);
+    proto->B_output(pstate, msg2give);  
+  }
+}
+
+/* with -g backlog, give A's flow messages for as long as its window has room */
+static void fillwindow(int flow)
+{
+  while (moremessages() && proto->A_ready(pstate, flow))
+    offermessage(A, flow);
+}
+
+/* handle an event at the entity where it occurs, then free it */
+static void handleevent(struct event *eventptr)
+{
+
+  curlp = eventptr->eventity;
+  PROF_BEGIN(m);
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",eventptr->evtime);
+    printf("  type: %d",eventptr->evtype);
+    if (eventptr->evtype==0)
+      printf(", timerinterrupt  ");
+    else if (eventptr->evtype==1)
+      printf(", fromlayer5 ");
+    else if (eventptr->evtype==PACE)
+      printf(", pace ");
+    else if (eventptr->evtype==HOP)
+      printf(", hop %d ", eventptr->hop + 1);
+    else
+      printf(", fromlayer3 ");
+    printf(" entity: %d",eventptr->eventity);
+    if (nflows > 1)
+      printf(" flow: %d",eventptr->flow);
+    printf("\n");
+  }
+  simtime = eventptr->evtime;     /* update time to next event time */
+  if (eventptr->evtype == HOP) {
+    forward(eventptr);            /* which moves the event on, or frees it */
+    PROF_END(PROF_EVENT + HOP, m);
+    return;
+  }
+  if (eventptr->evtype == FROM_LAYER5 ) {
+    if (moremessages()) {
+      if (generator == BACKLOG && eventptr->eventity == A)
+        fillwindow(eventptr->flow);
+      else {
+        generate_next_arrival(eventptr->flow);   /* set up future arrival */
+        offermessage(eventptr->eventity, eventptr->flow);
+      }
+    }
+    else if (TRACE > 2)
+        printf("          FROM_LAYER5: no more messages to send: \n");
+  }
+  else if (eventptr->evtype ==  FROM_LAYER3) {
+    narrived[eventptr->eventity]++;
+    /* lend the packet to the entity; it is freed along with the event */
+    if (eventptr->eventity ==A) {    /* deliver packet by calling */
+      PROF_BEGIN(cb);
+      proto->A_input(pstate, eventptr->pktptr); /* appropriate entity */
+      PROF_END(PROF_AINPUT, cb);
+    }
+    else {
+      PROF_BEGIN(cb);
+      proto->B_input(pstate, eventptr->pktptr);
+      PROF_END(PROF_BINPUT, cb);
+    }
+  }
+  else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+    timers[eventptr->eventity*nflows + eventptr->flow] = NULL;
+    if (eventptr->eventity == A) {
+      packets_timeout++;
+      flowstats[eventptr->flow].timeouts++;
+      PROF_BEGIN(cb);
+      proto->A_timerinterrupt(pstate, eventptr->flow);
+      PROF_END(PROF_ATIMER, cb);
+    }
+    else
+      proto->B_timerinterrupt(pstate);
+  }
+  else if (eventptr->evtype == PACE)
+    releasepaced(eventptr->flow);
+  else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+  }
+  /* an ACK or a timeout may have opened the window */
+  if (generator == BACKLOG && eventptr->eventity == A && eventptr->evtype != FROM_LAYER5)
+    fillwindow(eventptr->flow);
+  PROF_END(PROF_EVENT + eventptr->evtype, m);
+  free(eventptr);
+}
+
+/* run one logical process of a -p 2 run.  Each round both processes take
+   the packets the other sent in the last window, agree on the next window
+   [start, start + 1) and handle the events of their own that fall in it.
+   Whatever a process sends during the window is due at start + 1 or later */
+static void *runlp(void *arg)
+{
+  int me = (int)(long)arg, other = 1 - me;
+  struct lp *lp = &lps[me];
+  float start;
+  double end;                     /* past 2^24 start + 1 is no float */
+  int i;
+
+  curlp = me;
+  while (1) {
+    pthread_barrier_wait(&lpbarrier);
+    for (i=0; i<lps[other].outcount; i++)
+      heapinsert(lps[other].outbox[i]);
+    if (me == A) {
+      flushaccepts();
+      stopat = lps[B].stopat;
+    }
+    lp->next = evcount > 0 ? evheap[0]->evtime : -1.0;
+    pthread_barrier_wait(&lpbarrier);
+    lp->outcount = 0;
+    start = lps[A].next;
+    if (start < 0.0 || (lps[B].next >= 0.0 && lps[B].next < start))
+      start = lps[B].next;
+    if (start < 0.0)
+      break;                        /* no events left anywhere */
+    end = (double)start + 1;
+    while (evcount > 0 && evheap[0]->evtime < end)
+      handleevent(removeevent(0));
+  }
+  lp->last = simtime;
+  /* the heap belongs to this thread, and B's thread ends here */
+  free(evheap);
+  evheap = NULL;
+  evsize = 0;
+  evcount = 0;
+  return NULL;
+}
+
+/* run A's process on this thread and B's on another */
+static void runparallel(void)
+{
+  pthread_t thread;
+
+  if (pthread_barrier_init(&lpbarrier, NULL, 2) != 0
+      || pthread_create(&thread, NULL, runlp, (void *)(long)B) != 0) {
+    printf("could not start a thread for B.\n");
+    exit(EXIT_FAILURE);
+  }
+  runlp((void *)(long)A);
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&lpbarrier);
+  simtime = lps[A].last > lps[B].last ? lps[A].last : lps[B].last;
+}
+
+/* Real time (-W).  Each time unit takes realtime ms of wall clock, and the
+   loop sleeps until an event is due before handling it, on a timerfd so
+   that it can wait on the injected messages (-I) at the same time.  How
+   late the loop woke for each event is the scheduling jitter.  Injected
+   messages are lines "[flow] text" read from a file, usually a FIFO a
+   process outside writes to; each goes to A's layer 5 at the simulated
+   time it was read, cut or padded with spaces to the message length.
+   The run then lasts until the writer closes the file */
+static double realtime;           /* ms per time unit, 0 for as fast as possible */
+static char *injectpath;          /* file messages are injected from (-I) */
+static int injectfd = -1;
+static char injectbuf[MAXMSGSIZE + 64];
+static int injectlen;             /* bytes of a line not yet complete */
+static int ninjected, injectaccepted;
+static int rttimer;               /* the timerfd */
+static struct timespec rtbase;    /* wall clock at simulated time 0 */
+static long rtevents;             /* events handled on time or late */
+static double rtlatesum, rtlatesq, rtlatemax;  /* how late, in ns */
+static double rtcpu;              /* CPU seconds the run took */
+
+/* the wall clock time simulated time t is due at */
+static struct timespec rtdue(double t)
+{
+  struct timespec ts = rtbase;
+  double ns = t * realtime * 1e6;
+
+  ts.tv_sec += (time_t)(ns / 1e9);
+  ts.tv_nsec += (long)(ns - (time_t)(ns / 1e9) * 1e9);
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  else if (ts.tv_nsec < 0) {      /* t before the base, as when resuming at simtime */
+    ts.tv_sec--;
+    ts.tv_nsec += 1000000000L;
+  }
+  return ts;
+}
+
+/* simulated time now, by the wall clock */
+static float rtnow(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - rtbase.tv_sec) * 1e9 + (now.tv_nsec - rtbase.tv_nsec)) / (realtime * 1e6);
+}
+
+/* hand an injected line to A's layer 5 */
+static void injectmessage(char *line)
+{
+  char *text = line;
+  int flow = 0, n;
+
+  if (*line >= '0' && *line <= '9') {
+    flow = strtol(line, &text, 10);
+    while (*text == ' ' || *text == '\t')
+      text++;
+    if (flow >= nflows) {
+      printf("injected message for flow %d ignored, there are %d flows.\n", flow, nflows);
+      return;
+    }
+  }
+  n = strlen(text);
+  if (n > msgsize)
+    n = msgsize;
+  memset(msgdata, ' ', msgsize);
+  memcpy(msgdata, text, n);
+  if (TRACE>2)
+    printf("          INJECT: message for flow %d at %f: %.*s\n", flow, simtime, msgsize, msgdata);
+  curlp = A;
+  ninjected++;
+  flowstats[flow].offered++;
+  if (proto->A_output_bytes(pstate, flow, msgdata, msgsize)) {
+    injectaccepted++;
+    flowstats[flow].accepted++;
+    recordaccept(&flowstats[flow], simtime);
+  }
+}
+
+/* read what the injector has written, and inject each complete line */
+static void readinjected(void)
+{
+  char *line, *nl;
+  int n;
+
+  n = read(injectfd, injectbuf + injectlen, sizeof injectbuf - 1 - injectlen);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    /* the writer has gone: inject what is left, and stop listening */
+    injectbuf[injectlen] = '\0';
+    if (injectlen > 0)
+      injectmessage(injectbuf);
+    close(injectfd);
+    injectfd = -1;
+    return;
+  }
+  injectlen += n;
+  injectbuf[injectlen] = '\0';
+  line = injectbuf;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    injectmessage(line);
+    line = nl + 1;
+  }
+  injectlen -= line - injectbuf;
+  memmove(injectbuf, line, injectlen);
+  if (injectlen == sizeof injectbuf - 1) {
+    injectmessage(injectbuf);     /* a line too long to be a message */
+    injectlen = 0;
+  }
+}
+
+/* sleep until simulated time until is due, or -1 for no end.  Returns 1
+   once it is, and 0 if injected messages came in first, which may have
+   scheduled something earlier */
+static int rtwait(float until)
+{
+  struct itimerspec its;
+  struct pollfd fds[2];
+  struct timespec now;
+  uint64_t expirations;
+  double late;
+  int nfds = 0;
+
+  if (until >= 0.0) {
+    memset(&its, 0, sizeof its);
+    its.it_value = rtdue(until);
+    if (timerfd_settime(rttimer, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+      printf("could not set the real time timer.\n");
+      exit(EXIT_FAILURE);
+    }
+    fds[nfds].fd = rttimer;
+    fds[nfds++].events = POLLIN;
+  }
+  if (injectfd >= 0) {
+    fds[nfds].fd = injectfd;
+    fds[nfds++].events = POLLIN;
+  }
+  while (poll(fds, nfds, -1) < 0)
+    if (errno != EINTR) {
+      printf("could not wait for the next event.\n");
+      exit(EXIT_FAILURE);
+    }
+  if (injectfd >= 0 && fds[nfds-1].revents) {
+    simtime = rtnow();
+    if (until >= 0.0 && simtime > until)
+      simtime = until;            /* never past the event that is due */
+    readinjected();
+    return 0;
+  }
+  if (read(rttimer, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+    printf("could not read the real time timer.\n");
+    exit(EXIT_FAILURE);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  its.it_value = rtdue(until);
+  late = (now.tv_sec - its.it_value.tv_sec) * 1e9 + (now.tv_nsec - its.it_value.tv_nsec);
+  rtevents++;
+  rtlatesum += late;
+  rtlatesq += late * late;
+  if (late > rtlatemax)
+    rtlatemax = late;
+  return 1;
+}
+
+/* run the events in real time, taking injected messages as they come */
+static void runrealtime(void)
+{
+  struct timespec now, cpu0, cpu1;
+
+  rttimer = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (rttimer < 0) {
+    printf("could not create the real time timer.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (injectpath != NULL) {
+    /* a FIFO blocks here until its writer opens it */
+    injectfd = open(injectpath, O_RDONLY);
+    if (injectfd < 0) {
+      printf("could not open %s to inject messages from.\n", injectpath);
+      exit(EXIT_FAILURE);
+    }
+    fcntl(injectfd, F_SETFL, O_NONBLOCK);
+    injectlen = 0;
+  }
+  ninjected = injectaccepted = 0;
+  rtevents = 0;
+  rtlatesum = rtlatesq = rtlatemax = 0.0;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rtbase = now;
+  rtbase = rtdue(-simtime);       /* so that now is simtime */
+
+  while (evcount > 0 || injectfd >= 0) {
+    if (!rtwait(evcount > 0 ? evheap[0]->evtime : -1.0))
+      continue;
+    if (sampleout != NULL)
+      takesamples(evheap[0]->evtime);
+    handleevent(removeevent(0));
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+  rtcpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+  close(rttimer);
+}
+
+/* how closely the run kept to the wall clock, and what it cost */
+static void printrealtime(void)
+{
+  double avg, sd = 0.0;
+
+  printf("real time:  %g ms per time unit, %ld events on the clock \n", realtime, rtevents);
+  if (rtevents > 0) {
+    avg = rtlatesum / rtevents;
+    if (rtlatesq / rtevents > avg * avg)
+      sd = sssqrt(rtlatesq / rtevents - avg * avg);
+    printf("wake-up lateness (jitter):  average %.1f, sd %.1f, max %.1f us \n",
+           avg / 1e3, sd / 1e3, rtlatemax / 1e3);
+  }
+  if (simtime > 0.0)
+    printf("CPU:  %.3f s in all, %.3f us per simulated time unit, %.2f%% of the wall clock \n",
+           rtcpu, 1e6 * rtcpu / simtime, 100.0 * rtcpu / (simtime * realtime / 1e3));
+  if (injectpath != NULL)
+    printf("messages injected at A's layer 5:  %d, accepted %d \n", ninjected, injectaccepted);
+}
+
+/* how far after is from before, for the comparisons of -N, -F and -s */
+static void printchange(double before, double after, const char *less, const char *more)
+{
+  if (before > 0.0 && after <= before)
+    printf(": %.1f%% %s", 100.0 * (before - after) / before, less);
+  else if (before > 0.0)
+    printf(": %.1f%% %s", 100.0 * (after - before) / before, more);
+  printf("\n");
+}
+
+/* how busy each node of the path was, and what it lost */
+static void printhops(void)
+{
+  struct hop *h;
+  int i, to;
+
+  printf("path:  %d nodes after the access link\n", nhops);
+  for (i=0; i<nhops; i++) {
+    h = &hops[i];
+    printf("node %d:  %g bytes per time unit, delay %g, loss %g, queue %d packets \n",
+           i + 1, h->rate, h->delay, h->loss, h->qlimit);
+    for (to=B; to>=A; to--) {
+      printf("  %s:  %d packets, utilisation %.1f%%, queueing delay average %f, max queue %d, ",
+             to == B ? "A->B" : "B->A", h->arrived[to],
+             simtime > 0.0 ? 100.0 * h->busy[to] / simtime : 0.0,
+             h->arrived[to] > h->lost[to] + h->dropped[to]
+               ? h->qdelaysum[to] / (h->arrived[to] - h->lost[to] - h->dropped[to]) : 0.0,
+             h->maxqueue[to]);
+      printf("lost %d, dropped at a full queue %d \n", h->lost[to], h->dropped[to]);
+    }
+  }
+}
+
+/* print what the run did */
+static void report(void)
+{
+  char with[32];
+  double goodput = simtime > 0.0 ? bytes_delivered / simtime : 0.0;
+  double qdelay = ntolayer3[A] > nlost[A] ? qdelaysum[A] / (ntolayer3[A] - nlost[A]) : 0.0;
+
+  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",simtime,nsim);
+  if (partitioned)
+    printf("(logical processes, -p: random numbers differ from a run without -p)\n");
+  printf("number of messages dropped due to full window:  %d \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+  printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
   printf("number of packet resends by A:  %d \n", packets_resent);
   printf("number of correct packets received at B:  %d \n", packets_received);
   printf("number of messages delivered to application:  %d \n", messages_delivered);
+  if (messages_delivered > 0)
+    printf("message delay from A's layer 5 to B's layer 5:  average %f, max %f \n",
+           latency_sum / messages_delivered, latency_max);
+  if (sstarget > 0.0)
+    printsteady();
+  if (mtu != 20 || msgsize != 20) {
+    printf("message length %d bytes, mtu %d bytes (+%d header)\n", msgsize, mtu, PKTHEADER);
+    printf("bytes delivered to application:  %ld \n", bytes_delivered);
+    printf("bytes sent into layer 3 (headers, payload, ACKs, resends):  %ld \n", bytes_tolayer3[A] + bytes_tolayer3[B]);
+    if (bytes_tolayer3[A] + bytes_tolayer3[B] > 0)
+      printf("efficiency (delivered / sent):  %.4f \n",
+             (double)bytes_delivered / (bytes_tolayer3[A] + bytes_tolayer3[B]));
+    if (simtime > 0.0)
+      printf("goodput:  %.4f bytes per time unit \n", bytes_delivered / simtime);
+  }
+  if (qlimit > 0 || pairpace) {
+    printf("queueing delay A->B:  average %f, max %f \n", qdelay, qdelaymax[A]);
+    printf("queueing delay B->A:  average %f, max %f \n",
+           ntolayer3[B] > nlost[B] ? qdelaysum[B] / (ntolayer3[B] - nlost[B]) : 0.0, qdelaymax[B]);
+    if (pacing && ntolayer3[A] > 0)
+      printf("time held by the pacer:  average %f per packet sent by A \n", pacedsum / ntolayer3[A]);
+    if (qlimit > 0)
+      printf("packets dropped at a full queue:  A->B %d, B->A %d \n", nqdropped[A], nqdropped[B]);
+  }
+  if (pairnacks || pairfec || pairpace) {
+    printf("number of timeouts at A:  %d \n", packets_timeout);
+    if (nacks)
+      printf("number of NACKs sent by B:  %d, packets resent on a NACK:  %d \n",
+             nacks_sent, nack_resends);
+    if (fec)
+      printf("number of parity packets sent by A:  %d, packets rebuilt from parity at B:  %d \n",
+             parity_sent, fec_recovered);
+    if (nacks || fec || pacing) {
+      with[0] = '\0';
+      if (nacks)
+        strcat(with, "NACKs");
+      if (fec)
+        strcat(with, *with ? (pacing ? ", FEC" : " and FEC") : "FEC");
+      if (pacing)
+        strcat(with, *with ? " and pacing" : "pacing");
+      printf("timeouts at A without %s %d, with %s %d", with, lasttimeouts, with, packets_timeout);
+      printchange(lasttimeouts, packets_timeout, "fewer", "more");
+      printf("goodput without %s %.4f, with %s %.4f bytes per time unit", with, lastgoodput, with, goodput);
+      printchange(lastgoodput, goodput, "lower", "higher");
+      if (qlimit > 0 || pacing) {
+        printf("queueing delay A->B without %s %.4f, with %s %.4f", with, lastqdelay, with, qdelay);
+        printchange(lastqdelay, qdelay, "lower", "higher");
+        printf("packets lost A->B without %s %d, with %s %d", with, lastlost, with, nlost[A]);
+        printchange(lastlost, nlost[A], "fewer", "more");
+      }
+    }
+  }
+  if (rcvbuf > 0)
+    printbuffers();
+  if (nhops > 0)
+    printhops();
+  if (realtime > 0.0)
+    printrealtime();
+  if (nflows > 1)
+    printflows();
+  PROF_REPORT();
+}
+
+/* free what the run allocated and rewind what it used up, so that the next
+   run starts as if it were the first */
+static void endrun(void)
+{
+  int i;
+
+  proto->destroy(pstate);
+  for (i=0; i<nflows; i++)
+    free(flowstats[i].accepttimes);
+  free(flowstats);
+  free(timers);
+  free(onend);
+  for (i=0; i<2; i++) {
+    free(queued[i]);
+    queued[i] = NULL;
+  }
+  for (i=0; i<nhops; i++) {
+    free(hops[i].departs[A]);
+    free(hops[i].departs[B]);
+  }
+  if (pacers != NULL) {
+    for (i=0; i<nflows; i++)
+      free(pacers[i].waiting);
+    free(pacers);
+    pacers = NULL;
+  }
+  if (tracein != NULL)
+    rewind(tracein);
+  ssreset();
+}
+
+static void usage(const char *prog)
+{
+  printf("usage: %s [-m mtu] [-l message length] [-f flows] [-p 1|2] [-S time:file] [-R file] [-c target]\n", prog);
+  printf("       [-t interval:file] [-g generator] [-P protocol[:window],...] [-N] [-F k]\n");
+  printf("       [-B size:rate] [-q packets] [-s] [-H rate:delay:loss:queue,...]\n");
+  printf("       [-W ms] [-I file]\n");
+  printf("  -m  payload bytes per packet, 1..%d (default 20)\n", MAXPAYLOAD);
+  printf("  -l  bytes per layer 5 message, 0..%d (default 20)\n", MAXMSGSIZE);
+  printf("  -f  number of flows sharing the link, each with its own arrivals (default 1)\n");
+  printf("  -p  run A and B as logical processes with their own random numbers,\n");
+  printf("      1 on one thread, 2 on a thread each (same results as 1).  The draws\n");
+  printf("      and the order of simultaneous events differ from a run without -p,\n");
+  printf("      so -p results are not comparable with those of a run without it\n");
+  printf("  -S  save a snapshot to file once the run passes time (not with -p 2)\n");
+  printf("  -R  carry on from a snapshot.  -m, -l, -f and -P come from the snapshot;\n");
+  printf("      the answers to the prompts apply from the snapshot on\n");
+  printf("  -c  drop the warm-up (MSER-5) and stop once the 95%% confidence half-widths\n");
+  printf("      of delay and goodput are within this fraction of their means, e.g. 0.05.\n");
+  printf("      The number of messages entered becomes a limit\n");
+  printf("  -t  write window, channel and event list state to file every interval\n");
+  printf("      time units, as columns (not with -p 2)\n");
+  printf("  -g  how layer 5 offers messages, with lambda the mean gap entered:\n");
+  printf("      uniform      gaps uniform on [0,2*lambda] (default)\n");
+  printf("      poisson      gaps exponential\n");
+  printf("      onoff:ON:OFF poisson during on periods of mean length ON,\n");
+  printf("                   nothing during off periods of mean length OFF\n");
+  printf("      trace:FILE   at the times in FILE, one \"time [flow]\" per line\n");
+  printf("      backlog      whenever the window has room, until all messages are\n");
+  printf("                   accepted or time reaches messages * lambda\n");
+  printf("      onoff and trace can not be used with -S or -R\n");
+  printf("  -P  the protocols to run, one after another with the same settings:\n");
+  printf("      sw (stop-and-wait), gbn (go-back-N, the default) or sr (selective\n");
+  printf("      repeat), each with a window of at most 6.  More than one can not be\n");
+  printf("      used with -S, -R or -t\n");
+  printf("  -N  run each protocol twice, the second time with B sending a NACK for\n");
+  printf("      a missing packet (once per gap), and compare the timeouts at A\n");
+  printf("  -F  run each protocol twice, the second time with A sending the XOR parity\n");
+  printf("      of every k new packets, 1..%d, from which B rebuilds one lost packet of\n", MAXFEC);
+  printf("      the k.  Compare timeouts and goodput.  With -N, the second run has both.\n");
+  printf("      Data then goes in segments of mtu - %d - 4k bytes, to leave room for\n", FECHEADER(0));
+  printf("      the parity header, so mtu must be more than %d + 4k\n", FECHEADER(0));
+  printf("  -B  give B's layer 5 a buffer of size bytes per flow, at least a message\n");
+  printf("      and a packet, that it drains at rate bytes per time unit.  ACKs carry\n");
+  printf("      the room left as a window, and A probes a closed one.  Not with -S or -R\n");
+  printf("  -q  hold at most this many packets in each direction of the link, and drop\n");
+  printf("      one sent while it is full.  Not with -S or -R\n");
+  printf("  -s  run each protocol twice, the second time with A's packets, resends too,\n");
+  printf("      paced two windows per RTT (the protocol's timeout).  Compare the queueing\n");
+  printf("      delay and the loss A->B.  With -N or -F, the second run has those too.\n");
+  printf("      Not with -S or -R\n");
+  printf("  -H  put a line of store-and-forward nodes between the access link and the\n");
+  printf("      receiver, one per spec, from A's side.  Each sends on over a link of\n");
+  printf("      rate bytes per time unit and a fixed delay, loses packets with\n");
+  printf("      probability loss and queues at most queue of them.  Not with -p, -S or -R\n");
+  printf("  -W  run in real time, ms of wall clock per time unit, sleeping until each\n");
+  printf("      event is due.  Reports how late the wake-ups were and the CPU used per\n");
+  printf("      simulated time unit.  Not with -p 2, -S or -R\n");
+  printf("  -I  with -W, also give A's layer 5 the lines of file, usually a FIFO, as\n");
+  printf("      they are written, each \"[flow] text\" one message.  The run lasts until\n");
+  printf("      the writer closes it.  One protocol run only\n");
+  exit(EXIT_FAILURE);
+}
+
+/* add the runs of a -P list */
+static void addruns(char *list, const char *prog)
+{
+  char *spec;
+
+  for (spec = strtok(list, ","); spec != NULL; spec = strtok(NULL, ",")) {
+    runs = realloc(runs, (nruns + 1) * sizeof(struct run));
+    if (runs == 0) {
+      printf("memory allocation for runs failed.");
+      exit(EXIT_FAILURE);
+    }
+    runs[nruns].proto = parseprotocol(spec, &runs[nruns].window);
+    runs[nruns].nacks = 0;
+    runs[nruns].fec = 0;
+    runs[nruns].pace = 0;
+    if (runs[nruns].proto == NULL)
+      usage(prog);
+    nruns++;
+  }
+}
+
+/* add the nodes of a -H list */
+static void addhops(char *list, const char *prog)
+{
+  char *spec, *end;
+  struct hop *h;
+
+  for (spec = strtok(list, ","); spec != NULL; spec = strtok(NULL, ",")) {
+    hops = realloc(hops, (nhops + 1) * sizeof(struct hop));
+    if (hops == 0) {
+      printf("memory allocation for the path failed.");
+      exit(EXIT_FAILURE);
+    }
+    h = &hops[nhops++];
+    h->rate = strtod(spec, &end);
+    if (h->rate <= 0.0 || *end != ':')
+      usage(prog);
+    h->delay = strtod(end + 1, &end);
+    if (h->delay < 0.0 || *end != ':')
+      usage(prog);
+    h->loss = strtod(end + 1, &end);
+    if (h->loss < 0.0 || h->loss >= 1.0 || *end != ':')
+      usage(prog);
+    h->qlimit = strtol(end + 1, &end, 10);
+    if (h->qlimit < 1 || *end != '\0')
+      usage(prog);
+  }
+}
+
+/* follow each run with the same run with NACKs (-N), FEC (-F) and/or pacing (-s) */
+static void pairruns(void)
+{
+  int r;
+
+  runs = realloc(runs, 2 * nruns * sizeof(struct run));
+  if (runs == 0) {
+    printf("memory allocation for runs failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (r=nruns-1; r>=0; r--) {
+    runs[2*r] = runs[r];
+    runs[2*r+1] = runs[r];
+    runs[2*r+1].nacks = pairnacks;
+    runs[2*r+1].fec = pairfec;
+    runs[2*r+1].pace = pairpace;
+  }
+  nruns *= 2;
+}
+
+int main(int argc, char **argv)
+{
+  char *end, deflt[] = "gbn";
+  int c, r;
+
+  while ((c = getopt(argc, argv, "m:l:f:p:S:R:c:t:g:P:NF:B:q:sH:W:I:")) != -1) {
+    switch (c) {
+    case 'm':
+      mtu = atoi(optarg);
+      if (mtu < 1 || mtu > MAXPAYLOAD)
+        usage(argv[0]);
+      break;
+    case 'l':
+      msgsize = atoi(optarg);
+      if (msgsize < 0 || msgsize > MAXMSGSIZE)
+        usage(argv[0]);
+      break;
+    case 'f':
+      nflows = atoi(optarg);
+      if (nflows < 1)
+        usage(argv[0]);
+      break;
+    case 'p':
+      partitioned = atoi(optarg);
+      /* messages from layer 5 at B would not respect the lookahead */
+      if (partitioned < 1 || partitioned > 2 || (partitioned == 2 && BIDIRECTIONAL))
+        usage(argv[0]);
+      break;
+    case 'S':
+      snapat = strtod(optarg, &end);
+      if (*end != ':' || end[1] == '\0')
+        usage(argv[0]);
+      snapout = end + 1;
+      break;
+    case 'R':
+      snapin = optarg;
+      break;
+    case 't':
+      sampleint = strtod(optarg, &end);
+      if (sampleint <= 0.0 || *end != ':' || end[1] == '\0')
+        usage(argv[0]);
+      sampleout = end + 1;
+      break;
+    case 'c':
+      sstarget = atof(optarg);
+      if (sstarget <= 0.0)
+        usage(argv[0]);
+      break;
+    case 'g':
+      if (strcmp(optarg, "uniform") == 0)
+        generator = UNIFORM;
+      else if (strcmp(optarg, "poisson") == 0)
+        generator = POISSON;
+      else if (strcmp(optarg, "backlog") == 0)
+        generator = BACKLOG;
+      else if (strncmp(optarg, "onoff:", 6) == 0) {
+        generator = ONOFF;
+        onmean = strtod(optarg + 6, &end);
+        if (onmean <= 0.0 || *end != ':')
+          usage(argv[0]);
+        offmean = strtod(end + 1, &end);
+        if (offmean < 0.0 || *end != '\0')
+          usage(argv[0]);
+      }
+      else if (strncmp(optarg, "trace:", 6) == 0) {
+        generator = TRACE5;
+        tracein = fopen(optarg + 6, "r");
+        if (tracein == NULL) {
+          printf("could not open trace %s.\n", optarg + 6);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else
+        usage(argv[0]);
+      break;
+    case 'P':
+      addruns(optarg, argv[0]);
+      break;
+    case 'N':
+      pairnacks = 1;
+      break;
+    case 'F':
+      pairfec = atoi(optarg);
+      if (pairfec < 1 || pairfec > MAXFEC)
+        usage(argv[0]);
+      break;
+    case 'B':
+      rcvbuf = strtol(optarg, &end, 10);
+      if (rcvbuf < 1 || *end != ':')
+        usage(argv[0]);
+      drainrate = strtod(end + 1, &end);
+      if (drainrate <= 0.0 || *end != '\0')
+        usage(argv[0]);
+      break;
+    case 'q':
+      qlimit = atoi(optarg);
+      if (qlimit < 1)
+        usage(argv[0]);
+      break;
+    case 's':
+      pairpace = 1;
+      break;
+    case 'H':
+      addhops(optarg, argv[0]);
+      break;
+    case 'W':
+      realtime = atof(optarg);
+      if (realtime <= 0.0)
+        usage(argv[0]);
+      break;
+    case 'I':
+      injectpath = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nruns == 0)
+    addruns(deflt, argv[0]);
+  if (pairfec && mtu <= FECHEADER(pairfec))
+    usage(argv[0]);
+  if (pairnacks || pairfec || pairpace)
+    pairruns();
+  /* a snapshot or a time series is of one run */
+  if (nruns > 1 && (snapout != NULL || snapin != NULL || sampleout != NULL))
+    usage(argv[0]);
+  /* the processes of -p 2 are never both stopped between two events */
+  if ((snapout != NULL || sampleout != NULL) && partitioned == 2)
+    usage(argv[0]);
+  /* the on/off periods and the place in the trace are not in a snapshot */
+  if ((snapout != NULL || snapin != NULL) && (generator == ONOFF || generator == TRACE5))
+    usage(argv[0]);
+  /* nor is B's layer 5 buffer.  It has to hold a message and a packet, or
+     a partly reassembled message could keep B's window shut for good */
+  if (rcvbuf > 0 && (snapout != NULL || snapin != NULL || rcvbuf < msgsize + mtu))
+    usage(argv[0]);
+  /* nor the link's queue, nor the packets the pacer holds */
+  if ((qlimit > 0 || pairpace) && (snapout != NULL || snapin != NULL))
+    usage(argv[0]);
+  /* nor the path's nodes.  Their fixed delays may be under the one time
+     unit the logical processes count on */
+  if (nhops > 0 && (snapout != NULL || snapin != NULL || partitioned))
+    usage(argv[0]);
+  /* the wall clock is kept by one loop, and a FIFO can be read only once */
+  if (realtime > 0.0 && (snapout != NULL || snapin != NULL || partitioned == 2))
+    usage(argv[0]);
+  if (injectpath != NULL && (realtime <= 0.0 || nruns > 1))
+    usage(argv[0]);
+  if (snapin != NULL)
+    opensnapshot();
+  msgdata = malloc(msgsize + 1);
+  if (msgdata == 0) {
+    printf("memory allocation for message failed.");
+    exit(EXIT_FAILURE);
+  }
+  
+  readinputs();
+  for (r=0; r<nruns; r++) {
+    proto = runs[r].proto;
+    window = runs[r].window;
+    nacks = runs[r].nacks;
+    fec = runs[r].fec;
+    pacing = runs[r].pace;
+    if (nruns > 1) {
+      printf("\n===== protocol %s, window %d%s", proto->name, window, nacks ? ", NACKs" : "");
+      if (fec)
+        printf(", FEC k=%d", fec);
+      printf("%s =====\n", pacing ? ", paced" : "");
+    }
+    init();
+    pstate = proto->create(window);
+    useprotocol(proto, pstate);
+    if (snapin != NULL)
+      restoresnapshot();
+    if (sampleout != NULL)
+      opensamples();
+   
+    PROF_BEGIN(run);
+    if (partitioned == 2)
+      runparallel();
+    else if (realtime > 0.0)
+      runrealtime();
+    else
+      while (evcount > 0) {
+        if (snapout != NULL && evheap[0]->evtime > snapat) {
+          savesnapshot();
+          snapout = NULL;
+        }
+        if (sampleout != NULL)
+          takesamples(evheap[0]->evtime);
+        handleevent(removeevent(0));    /* get next event to simulate */
+      }
+    PROF_RUN(run);
+    if (snapout != NULL)
+      printf("run ended before time %f, no snapshot saved\n", snapat);
+
+    report();
+    lasttimeouts = packets_timeout;
+    lastgoodput = simtime > 0.0 ? bytes_delivered / simtime : 0.0;
+    lastqdelay = ntolayer3[A] > nlost[A] ? qdelaysum[A] / (ntolayer3[A] - nlost[A]) : 0.0;
+    lastlost = nlost[A];
+    if (sampleout != NULL)
+      closesamples();
+    endrun();
+  }
   return EXIT_SUCCESS;
 }
@@ -1,4 +1,9 @@
 extern int TRACE;
+extern int mtu;          /* payload bytes carried per packet, 1..MAXPAYLOAD */
+extern int nflows;       /* number of connections sharing the link, flows 0..nflows-1 */
+extern int nacks;        /* 1 if B may report missing packets with NACKs, read at create() */
+extern int rcvbuf;       /* bytes B's layer 5 buffers per flow, 0 for no limit, read at create() */
+extern int fec;          /* data packets per XOR parity packet, 0 for none, read at create() */
 
 /* statistics updated by GBN */
 extern int total_ACKs_received;
@@ -6,6 +11,11 @@ extern int packets_resent;       /* count of the number of packets resent  */
 extern int new_ACKs;      /* count of the number of acks correctly received */
 extern int packets_received;  /* count of the packets received by receiver */
 extern int window_full; /* count of the number of messages dropped due to full window */
+extern int nacks_sent;   /* count of the NACKs sent by B */
+extern int nack_resends; /* count of the packets A resent on a NACK rather than a timeout */
+extern int parity_sent;  /* count of the parity packets sent by A */
+extern int fec_recovered; /* count of the lost packets B rebuilt from parity */
+extern int probes_sent;  /* count of the zero window probes sent by A */
 
 #define   A    0
 #define   B    1
@@ -17,24 +27,56 @@ struct msg {
   char data[20];
 };
 
+#define MAXPAYLOAD 1024   /* largest mtu the emulator accepts */
+#define MAXMSGSIZE 65536  /* largest message layer 5 may hand down */
+
 /* a packet is the data unit passed from layer 4 (students code) to layer */
 /* 3 (teachers code).  Note the pre-defined packet structure, which all   */
-/* students must follow. */
+/* students must follow.  Only the first length bytes of payload are used */
 struct pkt {
   int seqnum;
   int acknum;
   int checksum;
-  char payload[20];
+  int length;             /* payload bytes in use, 0 for a pure ACK */
+  int flags;              /* PKT_ flags below */
+  int flow;               /* connection the packet belongs to */
+  char payload[MAXPAYLOAD];
 };
 
+/* bytes that hold a packet of at most n payload bytes, rounded up so that
+   such packets can sit one after another.  Whatever keeps packets rather
+   than handing them straight on sizes them by mtu with this, not by
+   sizeof(struct pkt), which is for the largest mtu there may be */
+#define PKTSIZE(n) (((int)offsetof(struct pkt, payload) + (n) + 3) & ~3)
+
+#define PKT_EOM    1      /* last segment of a layer 5 message */
+#define PKT_NACK   2      /* an ACK that also names, in seqnum, a packet B is missing */
+#define PKT_PARITY 4      /* XOR parity of a group of data packets, see fec.h */
+#define PKT_RWND   8      /* an ACK whose payload holds B's window, in packets */
+#define PKT_PROBE 16      /* asks B for its window, carries no data */
+
 /* send to A or B (int), packet to send */
 extern void tolayer3(int, struct pkt);  
 
+/* send to A or B (int), packet to send by reference.  The emulator takes */
+/* its own copy, so the caller may transmit straight from its window buffer */
+extern void tolayer3_ref(int, const struct pkt *);
+
 /* deliver to A or B (int), data to deliver */
-extern void tolayer5(int, char[20]); 
+extern void tolayer5(int, const char[20]); 
+
+/* deliver to A or B (int) of a flow (int), a reassembled message of any length (int) */
+extern void tolayer5_bytes(int, int, const char *, int);
+
+/* bytes B's layer 5 can take now on a flow (int), when rcvbuf is set */
+extern int layer5_room(int);
 
 /* start timer at A or B (int), increment */
 extern void starttimer(int, double);       
 
 /* stop timer at A or B (int) */
 extern void stoptimer(int);               
+
+/* as starttimer/stoptimer, for the timer of one flow (int) at A or B */
+extern void starttimer_flow(int, int, double);
+extern void stoptimer_flow(int, int);
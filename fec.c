@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "emulator.h"
+#include "fec.h"
+
+#define NOTINUSE (-1)
+
+/* the ints at the head of a parity packet's payload */
+static int getint(const struct pkt *p, int i)
+{
+  int x;
+
+  memcpy(&x, &p->payload[4*i], sizeof x);
+  return x;
+}
+
+static void putint(struct pkt *p, int i, int x)
+{
+  memcpy(&p->payload[4*i], &x, sizeof x);
+}
+
+struct pkt *fec_send(struct fecsender *f, const struct pkt *packet, int k)
+{
+  struct pkt *p;
+  int head = FECHEADER(k), i;
+
+  if (f->parity == NULL && (f->parity = malloc(PKTSIZE(mtu))) == NULL) {
+    printf("memory allocation for FEC failed.");
+    exit(EXIT_FAILURE);
+  }
+  p = f->parity;
+  if (f->count == 0) {
+    memset(p, 0, PKTSIZE(mtu));
+    p->seqnum = packet->seqnum;
+    p->acknum = k;
+    p->flags = PKT_PARITY;
+    p->flow = packet->flow;
+    p->length = head;
+  }
+  putint(p, 0, getint(p, 0) ^ (packet->length | packet->flags << 16));
+  putint(p, 1 + f->count, packet->checksum);
+  for (i = 0; i < packet->length; i++)
+    p->payload[head + i] ^= packet->payload[i];
+  if (head + packet->length > p->length)
+    p->length = head + packet->length;
+  if (++f->count < k)
+    return NULL;
+  f->count = 0;
+  return p;
+}
+
+void fec_freesender(struct fecsender *f)
+{
+  free(f->parity);
+}
+
+/* the packet in slot seq */
+static struct pkt *slot(const struct fecreceiver *f, int seq)
+{
+  return (struct pkt *)(f->slots + seq * PKTSIZE(mtu));
+}
+
+void fec_initreceiver(struct fecreceiver *f, int seqspace)
+{
+  f->slots = malloc(seqspace * PKTSIZE(mtu));
+  f->have = calloc(seqspace, 1);
+  if (f->slots == NULL || f->have == NULL) {
+    printf("memory allocation for FEC failed.");
+    exit(EXIT_FAILURE);
+  }
+  f->seqspace = seqspace;
+}
+
+void fec_freereceiver(struct fecreceiver *f)
+{
+  free(f->slots);
+  free(f->have);
+}
+
+void fec_receive(struct fecreceiver *f, const struct pkt *packet)
+{
+  if (packet->seqnum < 0 || packet->seqnum >= f->seqspace)
+    return;
+  /* the packet may be the slot itself, when a protocol takes a group again */
+  memmove(slot(f, packet->seqnum), packet, offsetof(struct pkt, payload) + packet->length);
+  f->have[packet->seqnum] = 1;
+}
+
+/* the sequence number of packet i of parity's group */
+static int memberseq(const struct fecreceiver *f, const struct pkt *parity, int i)
+{
+  return (parity->seqnum + i) % f->seqspace;
+}
+
+const struct pkt *fec_member(struct fecreceiver *f, const struct pkt *parity, int i)
+{
+  int seq = memberseq(f, parity, i);
+
+  if (f->have[seq] && slot(f, seq)->checksum == getint(parity, 1 + i))
+    return slot(f, seq);
+  return NULL;
+}
+
+const struct pkt *fec_repair(struct fecreceiver *f, const struct pkt *parity)
+{
+  const struct pkt *q;
+  struct pkt *p;
+  int k = parity->acknum, head, missing = -1, lengthflags, length, i, j;
+
+  if (parity->seqnum < 0 || parity->seqnum >= f->seqspace || k < 1 || k > MAXFEC)
+    return NULL;
+  for (i = 0; i < k; i++)
+    if (fec_member(f, parity, i) == NULL) {
+      if (missing >= 0)
+        return NULL;              /* two lost, parity can not help */
+      missing = i;
+    }
+  if (missing < 0)
+    return NULL;                  /* nothing lost */
+
+  head = FECHEADER(k);
+  lengthflags = getint(parity, 0);
+  for (i = 0; i < k; i++)
+    if (i != missing) {
+      q = fec_member(f, parity, i);
+      lengthflags ^= q->length | q->flags << 16;
+    }
+  length = lengthflags & 0xffff;
+  if (length > parity->length - head)
+    return NULL;
+
+  p = slot(f, memberseq(f, parity, missing));
+  p->seqnum = memberseq(f, parity, missing);
+  p->acknum = NOTINUSE;
+  p->checksum = getint(parity, 1 + missing);
+  p->length = length;
+  p->flags = lengthflags >> 16 & 0xffff;
+  p->flow = parity->flow;
+  memcpy(p->payload, &parity->payload[head], length);
+  for (i = 0; i < k; i++)
+    if (i != missing) {
+      q = fec_member(f, parity, i);
+      for (j = 0; j < length && j < q->length; j++)
+        p->payload[j] ^= q->payload[j];
+    }
+  f->have[p->seqnum] = 1;
+  return p;
+}
+
+void fec_endgroup(struct fecreceiver *f, const struct pkt *parity)
+{
+  int i;
+
+  if (parity->seqnum < 0 || parity->seqnum >= f->seqspace || parity->acknum > MAXFEC)
+    return;
+  for (i = 0; i < parity->acknum; i++)
+    f->have[memberseq(f, parity, i)] = 0;
+}
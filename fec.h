@@ -0,0 +1,47 @@
+/* XOR parity forward error correction, shared by the protocols.  The
+   sender folds each new data packet of a flow into a parity packet, and
+   once a group of k of them has gone out it sends the parity as well.
+   The receiver keeps the data packets it gets, and when a group's parity
+   arrives with just one of the group missing, it rebuilds that one.
+
+   A parity packet has PKT_PARITY set, the seqnum of the group's first
+   packet (the others follow on from it) and k in acknum.  Its payload is
+   the XOR of the group's lengths (low 16 bits) and flags (high 16 bits),
+   the checksum of each packet of the group, then the XOR of their
+   payloads.  The checksums let the receiver tell the group's packets from
+   older ones that had the same sequence number.  So that the parity fits
+   in mtu, the protocols cut data into segments of mtu - FECHEADER(k) */
+#define MAXFEC 6                    /* largest k: a group may not wrap onto itself in GBN's sequence space */
+#define FECHEADER(k) (4 + 4*(k))    /* parity payload bytes ahead of the XORed payloads */
+
+struct fecsender {
+  struct pkt *parity;               /* the group so far, allocated by the first fec_send() */
+  int count;                        /* data packets in it */
+};
+
+struct fecreceiver {
+  char *slots;                      /* by seqnum, the last data packet received, PKTSIZE(mtu) bytes each */
+  char *have;                       /* which slots hold one */
+  int seqspace;
+};
+
+/* fold a new data packet into the group.  Returns the group's parity once
+   k packets are in, for the caller to checksum and send, else NULL */
+extern struct pkt *fec_send(struct fecsender *, const struct pkt *, int k);
+extern void fec_freesender(struct fecsender *);
+
+extern void fec_initreceiver(struct fecreceiver *, int seqspace);
+extern void fec_freereceiver(struct fecreceiver *);
+
+/* keep an uncorrupted data packet */
+extern void fec_receive(struct fecreceiver *, const struct pkt *);
+
+/* packet i of parity's group as received or rebuilt, NULL if it is not here */
+extern const struct pkt *fec_member(struct fecreceiver *, const struct pkt *parity, int i);
+
+/* rebuild the one packet of parity's group that is missing.  NULL if none
+   or more than one is.  The caller checks the rebuilt packet's checksum */
+extern const struct pkt *fec_repair(struct fecreceiver *, const struct pkt *parity);
+
+/* forget the group, once its parity has been dealt with */
+extern void fec_endgroup(struct fecreceiver *, const struct pkt *parity);
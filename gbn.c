@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include "emulator.h"
+#include "protocol.h"
 #include "gbn.h"
+#include "fec.h"
 
 /* ******************************************************************
    Go Back N protocol.  Adapted from J.F.Kurose
@@ -24,240 +28,652 @@
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
-                          MUST BE SET TO 6 when submitting assignment */
+                          MUST BE SET TO 6 when submitting assignment.
+                          An instance may be created with a smaller window */
 #define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
    original checksum.  This procedure must generate a different checksum to the original if
-   the packet is corrupted.
+   the packet is corrupted.  The packet is read in place rather than copied.
 */
-int ComputeChecksum(struct pkt packet)
+static int ComputeChecksum_ref(const struct pkt *packet)
 {
   int checksum = 0;
   int i;
 
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
-    checksum += (int)(packet.payload[i]);
+  checksum = packet->seqnum;
+  checksum += packet->acknum;
+  checksum += packet->length;
+  checksum += packet->flags;
+  checksum += packet->flow;
+  for ( i=0; i<packet->length && i<MAXPAYLOAD; i++ )
+    checksum += (int)(packet->payload[i]);
 
   return checksum;
 }
 
-bool IsCorrupted(struct pkt packet)
+static bool IsCorrupted_ref(const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  if (packet->checksum == ComputeChecksum_ref(packet))
     return (false);
   else
     return (true);
 }
 
+/* one go-back-N connection per flow, both ends.  A and B keep to their own half */
+struct gbn {
+  int windowsize;                 /* packets A may have unACKed, 1..WINDOWSIZE */
+  int nacks;                      /* B sends NACKs */
+  int fec;                        /* data packets per parity packet, 0 for none */
+  int segment;                    /* payload bytes per data packet: mtu, less the
+                                     parity header with FEC so the parity fits too */
+  int rcvbuf;                     /* bytes B's layer 5 buffers per flow, 0 for no limit */
+  struct sender *senders;         /* A's state, indexed by flow */
+  struct receiver *receivers;     /* B's state, indexed by flow */
+};
 
-/********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/********* Sender (A) variables and functions ************/
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+/* A keeps one of these for each flow */
+struct sender {
+  char *buffer;                   /* WINDOWSIZE packets waiting for ACK, PKTSIZE(mtu) bytes each */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int nextseqnum;                 /* the next sequence number to be used by the sender */
+  char *pending;                  /* segments of the current message that did not fit in the window */
+  int pendingfirst, pendinglast;  /* unsent bytes are pending[pendingfirst..pendinglast-1] */
+  int pendingsize;                /* bytes allocated for pending */
+  struct fecsender fec;           /* parity of the new packets sent since the last one */
+  int rwnd;                       /* packets B last said it has room for */
+  int probing;                    /* the timer is probing a closed window */
+};
+
+/* the packet in slot i of the flow's window buffer */
+static struct pkt *A_slot(const struct sender *s, int i)
 {
-  struct pkt sendpkt;
-  int i;
+  return (struct pkt *)(s->buffer + i * PKTSIZE(mtu));
+}
 
-  /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+/* packets A may have unACKed: its window, or fewer if B has less room */
+static int A_sendwindow(const struct gbn *g, const struct sender *s)
+{
+  return s->rwnd < g->windowsize ? s->rwnd : g->windowsize;
+}
 
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+/* put one segment of at most mtu bytes in the window and send it. eom marks the last segment */
+static void A_sendsegment(struct gbn *g, int flow, const char *data, int length, bool eom)
+{
+  struct sender *s = &g->senders[flow];
+  struct pkt *sendpkt, *parity;
+
+  /* create packet directly in its window buffer slot */
+  /* windowlast will always be 0 for alternating bit; but not for GoBackN */
+  s->windowlast = (s->windowlast + 1) % WINDOWSIZE;
+  sendpkt = A_slot(s, s->windowlast);
+  sendpkt->seqnum = s->nextseqnum;
+  sendpkt->acknum = NOTINUSE;
+  sendpkt->length = length;
+  sendpkt->flags = eom ? PKT_EOM : 0;
+  sendpkt->flow = flow;
+  memcpy(sendpkt->payload, data, length);
+  sendpkt->checksum = ComputeChecksum_ref(sendpkt);
+  s->windowcount++;
 
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+  /* send out packet */
+  if (TRACE > 0)
+    printf("Sending packet %d to layer 3\n", sendpkt->seqnum);
+  tolayer3_ref (A, sendpkt);
 
-    /* send out packet */
+  /* every g->fec new packets, the parity of the group goes out behind them.
+     It is never ACKed or resent */
+  if (g->fec && (parity = fec_send(&s->fec, sendpkt, g->fec)) != NULL) {
+    parity->checksum = ComputeChecksum_ref(parity);
     if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
+      printf("Sending parity of packets %d.. to layer 3\n", parity->seqnum);
+    tolayer3_ref(A, parity);
+    parity_sent++;
+  }
 
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
+  /* start timer if first packet in window */
+  if (s->windowcount == 1)
+    starttimer_flow(A,flow,RTT);
 
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+  /* get next sequence number, wrap back to 0 */
+  s->nextseqnum = (s->nextseqnum + 1) % SEQSPACE;
+}
+
+/* send as many pending segments as the window allows */
+static void A_sendpending(struct gbn *g, int flow)
+{
+  struct sender *s = &g->senders[flow];
+  int n;
+
+  while (s->pendingfirst < s->pendinglast && s->windowcount < A_sendwindow(g, s)) {
+    n = s->pendinglast - s->pendingfirst;
+    if (n > g->segment)
+      n = g->segment;
+    A_sendsegment(g, flow, &s->pending[s->pendingfirst], n, s->pendingfirst + n == s->pendinglast);
+    s->pendingfirst += n;
+  }
+}
+
+/* called from layer 5 (application layer), passed a message of any length up
+   to MAXMSGSIZE to be sent to the other side on the given flow.  The
+   message is cut into segments of mtu bytes.  Whatever does not fit in the
+   window waits in the pending buffer, so while it drains the window stays
+   full and further messages are dropped.  Returns 1 if the message was
+   accepted */
+static int A_output_bytes(void *inst, int flow, const char *data, int length)
+{
+  struct gbn *g = inst;
+  struct sender *s = &g->senders[flow];
+  int n, sent;
+
+  /* if not blocked waiting on ACK */
+  if ( s->windowcount < A_sendwindow(g, s) && length <= MAXMSGSIZE) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+
+    /* send the leading segments straight from the caller's buffer */
+    sent = 0;
+    do {
+      n = length - sent;
+      if (n > g->segment)
+        n = g->segment;
+      A_sendsegment(g, flow, data + sent, n, sent + n == length);
+      sent += n;
+    } while (sent < length && s->windowcount < A_sendwindow(g, s));
+
+    /* keep the rest until ACKs open the window. The buffer is only
+       allocated for flows that send messages bigger than the window */
+    s->pendingfirst = 0;
+    s->pendinglast = length - sent;
+    if (s->pendinglast > s->pendingsize) {
+      s->pending = realloc(s->pending, s->pendinglast);
+      if (s->pending == NULL) {
+        printf("memory allocation for pending segments failed.");
+        exit(EXIT_FAILURE);
+      }
+      s->pendingsize = s->pendinglast;
+    }
+    if (s->pendinglast > 0)       /* pending is NULL until first needed */
+      memcpy(s->pending, data + sent, s->pendinglast);
+    return 1;
   }
   /* if blocked,  window is full */
   else {
     if (TRACE > 0)
       printf("----A: New message arrives, send window is full\n");
     window_full++;
+    return 0;
   }
 }
 
 
+/* resend every packet in the flow's window and start its timer again */
+static void A_resendwindow(struct sender *s, int flow)
+{
+  int i;
+
+  for(i=0; i<s->windowcount; i++) {
+
+    if (TRACE > 0)
+      printf ("---A: resending packet %d\n", A_slot(s, (s->windowfirst+i) % WINDOWSIZE)->seqnum);
+
+    tolayer3_ref(A,A_slot(s, (s->windowfirst+i) % WINDOWSIZE));
+    packets_resent++;
+    if (i==0) starttimer_flow(A,flow,RTT);
+  }
+}
+
+/* ask B for its window, with a packet that carries no data */
+static void A_sendprobe(int flow)
+{
+  struct pkt probe;
+
+  probe.seqnum = NOTINUSE;
+  probe.acknum = NOTINUSE;
+  probe.length = 0;
+  probe.flags = PKT_PROBE;
+  probe.flow = flow;
+  probe.checksum = ComputeChecksum_ref(&probe);
+  if (TRACE > 0)
+    printf("----A: window is closed, send probe!\n");
+  tolayer3_ref(A, &probe);
+  probes_sent++;
+}
+
+/* act on the window B advertised.  Once it opens, what waits for it is
+   sent.  While it is closed with nothing in flight no ACK would come to
+   open it, so the timer probes for it instead */
+static void A_watchwindow(struct gbn *g, int flow)
+{
+  struct sender *s = &g->senders[flow];
+
+  if (s->probing && s->rwnd > 0) {
+    stoptimer_flow(A, flow);
+    s->probing = 0;
+  }
+  A_sendpending(g, flow);
+  if (s->rwnd == 0 && s->windowcount == 0 && !s->probing) {
+    starttimer_flow(A, flow, RTT);
+    s->probing = 1;
+  }
+}
+
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
+   The packet is only borrowed for the duration of the call
 */
-void A_input(struct pkt packet)
+static void A_input(void *inst, const struct pkt *packet)
 {
+  struct gbn *g = inst;
+  struct sender *s;
   int ackcount = 0;
   int i;
 
   /* if received ACK is not corrupted */
-  if (!IsCorrupted(packet)) {
+  if (!IsCorrupted_ref(packet)) {
     if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
+      printf("----A: uncorrupted ACK %d is received\n",packet->acknum);
     total_ACKs_received++;
+    s = &g->senders[packet->flow];
+    if (packet->flags & PKT_RWND)
+      memcpy(&s->rwnd, packet->payload, sizeof s->rwnd);
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (s->windowcount != 0) {
+          int seqfirst = A_slot(s, s->windowfirst)->seqnum;
+          int seqlast = A_slot(s, s->windowlast)->seqnum;
           /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+          if (((seqfirst <= seqlast) && (packet->acknum >= seqfirst && packet->acknum <= seqlast)) ||
+              ((seqfirst > seqlast) && (packet->acknum >= seqfirst || packet->acknum <= seqlast))) {
 
             /* packet is a new ACK */
             if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
+              printf("----A: ACK %d is not a duplicate\n",packet->acknum);
             new_ACKs++;
 
             /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
+            if (packet->acknum >= seqfirst)
+              ackcount = packet->acknum + 1 - seqfirst;
             else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
+              ackcount = SEQSPACE - seqfirst + packet->acknum;
 
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            s->windowfirst = (s->windowfirst + ackcount) % WINDOWSIZE;
 
             /* delete the acked packets from window buffer */
             for (i=0; i<ackcount; i++)
-              windowcount--;
+              s->windowcount--;
 
 	    /* start timer again if there are still more unacked packets in window */
-            stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
+            stoptimer_flow(A, packet->flow);
+            if (s->windowcount > 0)
+              starttimer_flow(A, packet->flow, RTT);
+
+            /* the window has opened, continue with the current message */
+            A_sendpending(g, packet->flow);
 
           }
         }
         else
           if (TRACE > 0)
         printf ("----A: duplicate ACK received, do nothing!\n");
+
+    /* a NACK names the packet B is waiting for.  If it is the oldest in
+       the window, go back N now rather than when the timer goes off */
+    if ((packet->flags & PKT_NACK) && s->windowcount != 0
+        && A_slot(s, s->windowfirst)->seqnum == packet->seqnum) {
+      if (TRACE > 0)
+        printf("----A: NACK %d is received, resend packets!\n", packet->seqnum);
+      nack_resends += s->windowcount;
+      stoptimer_flow(A, packet->flow);
+      A_resendwindow(s, packet->flow);
+    }
+
+    if (packet->flags & PKT_RWND)
+      A_watchwindow(g, packet->flow);
   }
   else
     if (TRACE > 0)
       printf ("----A: corrupted ACK is received, do nothing!\n");
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt(void)
+/* called when the timer of one of A's flows goes off */
+static void A_timerinterrupt(void *inst, int flow)
 {
-  int i;
+  struct gbn *g = inst;
+  struct sender *s = &g->senders[flow];
 
+  if (s->probing) {
+    A_sendprobe(flow);
+    starttimer_flow(A, flow, RTT);
+    return;
+  }
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
-
-  for(i=0; i<windowcount; i++) {
-
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
-
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
-    if (i==0) starttimer(A,RTT);
-  }
+  A_resendwindow(s, flow);
 }
 
 
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+static void A_init(struct gbn *g)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
+  struct sender *senders;
+  int flow;
+
+  senders = g->senders = calloc(nflows, sizeof(struct sender));
+  if (senders == NULL) {
+    printf("memory allocation for sender state failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  /* initialise A's window, buffer and sequence number for every flow */
+  for (flow = 0; flow < nflows; flow++) {
+    senders[flow].nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+    senders[flow].windowfirst = 0;
+    senders[flow].windowlast = -1;   /* windowlast is where the last packet sent is stored.
 		     new packets are placed in winlast + 1
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+    senders[flow].windowcount = 0;
+    senders[flow].rwnd = WINDOWSIZE;  /* until B says otherwise */
+    senders[flow].buffer = malloc(WINDOWSIZE * PKTSIZE(mtu));
+    if (senders[flow].buffer == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/* packets of the flow sent and not yet ACKed, for the emulator's sampler */
+static int A_windowcount(void *inst, int flow)
+{
+  struct gbn *g = inst;
+
+  return g->senders[flow].windowcount;
+}
+
+/* 1 if the flow's window has room, so that A_output_bytes would take a
+   message rather than drop it */
+static int A_ready(void *inst, int flow)
+{
+  struct gbn *g = inst;
+
+  return g->senders[flow].windowcount < A_sendwindow(g, &g->senders[flow]);
+}
+
+/* write A's windows and any pending segments, for a snapshot */
+static void A_save(void *inst, void (*put)(const void *, int))
+{
+  struct gbn *g = inst;
+  struct sender *s;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    s = &g->senders[flow];
+    put(s, sizeof(struct sender));
+    put(s->buffer, WINDOWSIZE * PKTSIZE(mtu));
+    if (s->pendinglast > s->pendingfirst)
+      put(&s->pending[s->pendingfirst], s->pendinglast - s->pendingfirst);
+  }
+}
+
+/* read back what A_save wrote */
+static void A_restore(void *inst, void (*get)(void *, int))
+{
+  struct gbn *g = inst;
+  struct sender *s;
+  struct fecsender fec;
+  char *pending, *buffer;
+  int flow, size;
+
+  for (flow = 0; flow < nflows; flow++) {
+    s = &g->senders[flow];
+    pending = s->pending;       /* the pointers in the snapshot are stale */
+    size = s->pendingsize;
+    buffer = s->buffer;
+    fec = s->fec;
+    get(s, sizeof(struct sender));
+    s->buffer = buffer;
+    s->fec = fec;
+    get(s->buffer, WINDOWSIZE * PKTSIZE(mtu));
+    s->pendinglast -= s->pendingfirst;
+    s->pendingfirst = 0;
+    if (s->pendinglast > size) {
+      pending = realloc(pending, s->pendinglast);
+      if (pending == NULL) {
+        printf("memory allocation for pending segments failed.");
+        exit(EXIT_FAILURE);
+      }
+      size = s->pendinglast;
+    }
+    s->pending = pending;
+    s->pendingsize = size;
+    if (s->pendinglast > 0)
+      get(s->pending, s->pendinglast);
+  }
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+/* B keeps one of these for each flow */
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int nextseqnum;     /* the sequence number for the next packets sent by B */
+  int nacked;         /* 1 once a NACK has named expectedseqnum */
+  char *reassembly;   /* segments of the message being received */
+  int reassemblylen;  /* bytes of it received so far */
+  int reassemblysize; /* bytes allocated for reassembly */
+  struct fecreceiver fec; /* the packets of the current parity groups */
+};
+
+/* add an in-order segment to the message being reassembled and hand the
+   message to layer 5 once it is complete.  A single-segment message is
+   handed up straight from the packet */
+static void B_deliver(struct gbn *g, const struct pkt *packet)
+{
+  struct receiver *r = &g->receivers[packet->flow];
+  int len = r->reassemblylen + packet->length;
+
+  if ((packet->flags & PKT_EOM) && r->reassemblylen == 0)
+    tolayer5_bytes(B, packet->flow, packet->payload, packet->length);
+  else if (len <= MAXMSGSIZE) {
+    if (len > r->reassemblysize) {
+      r->reassembly = realloc(r->reassembly, len);
+      if (r->reassembly == NULL) {
+        printf("memory allocation for reassembly failed.");
+        exit(EXIT_FAILURE);
+      }
+      r->reassemblysize = len;
+    }
+    memcpy(&r->reassembly[r->reassemblylen], packet->payload, packet->length);
+    r->reassemblylen = len;
+    if (packet->flags & PKT_EOM) {
+      tolayer5_bytes(B, packet->flow, r->reassembly, r->reassemblylen);
+      r->reassemblylen = 0;
+    }
+  }
+}
+
 
+/* the packets B's layer 5 buffer has room for, after the message being
+   reassembled */
+static int B_window(const struct receiver *r, int flow)
+{
+  int room = layer5_room(flow) - r->reassemblylen;
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+  return room > 0 ? room / mtu : 0;
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at B.
+   The packet is only borrowed for the duration of the call */
+static void B_input(void *inst, const struct pkt *packet)
 {
+  struct gbn *g = inst;
+  struct receiver *r = &g->receivers[packet->flow];
   struct pkt sendpkt;
-  int i;
+  const struct pkt *rebuilt, *member;
+  int nack = 0, refused, window, i;
+
+  /* a parity packet is not ACKed.  When it rebuilds a lost packet of its
+     group, the rest of the group, refused before as out of order, is taken
+     again behind it */
+  if (packet->flags & PKT_PARITY) {
+    if (!IsCorrupted_ref(packet) && (rebuilt = fec_repair(&r->fec, packet)) != NULL
+        && !IsCorrupted_ref(rebuilt)) {
+      if (TRACE > 0)
+        printf("----B: packet %d rebuilt from parity\n", rebuilt->seqnum);
+      fec_recovered++;
+      for (i = 0; i < packet->acknum; i++) {
+        member = fec_member(&r->fec, packet, i);
+        if (member != NULL && member->seqnum == r->expectedseqnum)
+          B_input(g, member);
+      }
+    }
+    fec_endgroup(&r->fec, packet);
+    return;
+  }
+  if (g->fec && !IsCorrupted_ref(packet))
+    fec_receive(&r->fec, packet);
+
+  /* a packet B's layer 5 has no room for yet is refused as if out of
+     order, and the window in the ACK holds A back */
+  refused = g->rcvbuf && packet->seqnum == r->expectedseqnum
+            && r->reassemblylen + packet->length > layer5_room(packet->flow);
 
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  if  ( (!IsCorrupted_ref(packet))  && (packet->seqnum == r->expectedseqnum) && !refused ) {
     if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
+      printf("----B: packet %d is correctly received, send ACK!\n",packet->seqnum);
     packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
+    B_deliver(g, packet);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    sendpkt.acknum = r->expectedseqnum;
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+    r->nacked = 0;
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
     if (TRACE > 0)
       printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
+    if (r->expectedseqnum == 0)
       sendpkt.acknum = SEQSPACE - 1;
     else
-      sendpkt.acknum = expectedseqnum - 1;
+      sendpkt.acknum = r->expectedseqnum - 1;
+
+    /* and name the packet B is waiting for, once only, so that the rest
+       of a window arriving behind a loss does not become a burst of NACKs */
+    if (g->nacks && !r->nacked && !refused && !(packet->flags & PKT_PROBE)) {
+      if (TRACE > 0)
+        printf("----B: send NACK %d!\n", r->expectedseqnum);
+      nack = 1;
+      r->nacked = 1;
+      nacks_sent++;
+    }
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ )
-    sendpkt.payload[i] = '0';
+  /* create packet.  A NACK carries the missing sequence number instead */
+  sendpkt.seqnum = nack ? r->expectedseqnum : r->nextseqnum;
+  r->nextseqnum = (r->nextseqnum + 1) % 2;
+
+  /* we don't have any data to send, so the ACK carries no payload but,
+     with a bounded layer 5 buffer, B's window */
+  sendpkt.length = 0;
+  sendpkt.flags = nack ? PKT_NACK : 0;
+  sendpkt.flow = packet->flow;
+  if (g->rcvbuf) {
+    window = B_window(r, packet->flow);
+    memcpy(sendpkt.payload, &window, sizeof window);
+    sendpkt.length = sizeof window;
+    sendpkt.flags |= PKT_RWND;
+  }
 
   /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt);
+  sendpkt.checksum = ComputeChecksum_ref(&sendpkt);
 
   /* send out packet */
-  tolayer3 (B, sendpkt);
+  tolayer3_ref (B, &sendpkt);
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+static void B_init(struct gbn *g)
+{
+  struct receiver *receivers;
+  int flow;
+
+  receivers = g->receivers = calloc(nflows, sizeof(struct receiver));
+  if (receivers == NULL) {
+    printf("memory allocation for receiver state failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  for (flow = 0; flow < nflows; flow++) {
+    receivers[flow].expectedseqnum = 0;
+    receivers[flow].nextseqnum = 1;
+    if (g->fec)
+      fec_initreceiver(&receivers[flow].fec, SEQSPACE);
+  }
+}
+
+/* write B's state and any partly reassembled messages, for a snapshot */
+static void B_save(void *inst, void (*put)(const void *, int))
+{
+  struct gbn *g = inst;
+  struct receiver *r;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    r = &g->receivers[flow];
+    put(r, sizeof(struct receiver));
+    if (r->reassemblylen > 0)
+      put(r->reassembly, r->reassemblylen);
+  }
+}
+
+/* read back what B_save wrote */
+static void B_restore(void *inst, void (*get)(void *, int))
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  struct gbn *g = inst;
+  struct receiver *r;
+  struct fecreceiver fec;
+  char *reassembly;
+  int flow, size;
+
+  for (flow = 0; flow < nflows; flow++) {
+    r = &g->receivers[flow];
+    reassembly = r->reassembly;  /* the pointers in the snapshot are stale */
+    size = r->reassemblysize;
+    fec = r->fec;
+    get(r, sizeof(struct receiver));
+    r->fec = fec;
+    if (r->reassemblylen > size) {
+      reassembly = realloc(reassembly, r->reassemblylen);
+      if (reassembly == NULL) {
+        printf("memory allocation for reassembly failed.");
+        exit(EXIT_FAILURE);
+      }
+      size = r->reassemblylen;
+    }
+    r->reassembly = reassembly;
+    r->reassemblysize = size;
+    if (r->reassemblylen > 0)
+      get(r->reassembly, r->reassemblylen);
+  }
 }
 
 /******************************************************************************
@@ -265,11 +681,69 @@ void B_init(void)
  *****************************************************************************/
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)
+static void B_output(void *inst, struct msg message)
 {
 }
 
 /* called when B's timer goes off */
-void B_timerinterrupt(void)
+static void B_timerinterrupt(void *inst)
+{
+}
+
+
+
+/********* The instance ************/
+
+/* both ends of a connection for each of the nflows flows, with a window of
+   at most WINDOWSIZE packets */
+static void *create(int windowsize)
 {
+  struct gbn *g;
+
+  g = calloc(1, sizeof(struct gbn));
+  if (g == NULL) {
+    printf("memory allocation for protocol instance failed.");
+    exit(EXIT_FAILURE);
+  }
+  g->windowsize = windowsize;
+  g->nacks = nacks;
+  g->fec = fec;
+  g->segment = fec ? mtu - FECHEADER(fec) : mtu;
+  g->rcvbuf = rcvbuf;
+  A_init(g);
+  B_init(g);
+  return g;
 }
+
+static void destroy(void *inst)
+{
+  struct gbn *g = inst;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    free(g->senders[flow].buffer);
+    free(g->senders[flow].pending);
+    fec_freesender(&g->senders[flow].fec);
+    free(g->receivers[flow].reassembly);
+    if (g->fec)
+      fec_freereceiver(&g->receivers[flow].fec);
+  }
+  free(g->senders);
+  free(g->receivers);
+  free(g);
+}
+
+const struct protocol gbn_protocol = {
+  "gbn", WINDOWSIZE, RTT, create, destroy,
+  A_output_bytes, A_input, B_input, A_timerinterrupt, A_windowcount, A_ready,
+  A_save, A_restore, B_save, B_restore,
+  B_output, B_timerinterrupt
+};
+
+/* with room for one packet in flight, go-back-N is stop-and-wait */
+const struct protocol sw_protocol = {
+  "sw", 1, RTT, create, destroy,
+  A_output_bytes, A_input, B_input, A_timerinterrupt, A_windowcount, A_ready,
+  A_save, A_restore, B_save, B_restore,
+  B_output, B_timerinterrupt
+};
@@ -0,0 +1,15 @@
+/* The by-value entry points of the original assignment, for code written
+   against them.  They drive the instance last handed to useprotocol(), on
+   flow 0, with a message or packet of the original 20 byte size.  Callers
+   that know their protocol should use its struct protocol instead, which
+   does not copy packets */
+extern void useprotocol(const struct protocol *, void *);  /* protocol, instance */
+
+extern void A_output(struct msg);
+extern void A_input(struct pkt);
+extern void B_input(struct pkt);
+extern void A_timerinterrupt(void);
+
+/* included for extension to bidirectional communication */
+extern void B_output(struct msg);
+extern void B_timerinterrupt(void);
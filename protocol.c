@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+#include "protocol.h"
+#include "legacy.h"
+#include "gbn.h"
+#include "sr.h"
+
+/* the protocols a driver can be asked for by name */
+const struct protocol *const protocols[] = {
+  &sw_protocol,
+  &gbn_protocol,
+  &sr_protocol,
+  NULL
+};
+
+const struct protocol *findprotocol(const char *name)
+{
+  int i;
+
+  for (i = 0; protocols[i] != NULL; i++)
+    if (strcmp(protocols[i]->name, name) == 0)
+      return protocols[i];
+  return NULL;
+}
+
+/* the protocol spec asks for, as "name" or "name:window", and the window,
+   the protocol's largest if spec gives none.  NULL if there is no such
+   protocol or the window does not suit it */
+const struct protocol *parseprotocol(const char *spec, int *window)
+{
+  const struct protocol *p;
+  char name[16];
+  const char *colon;
+  char *end;
+  size_t len;
+
+  colon = strchr(spec, ':');
+  len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+  if (len >= sizeof name)
+    return NULL;
+  memcpy(name, spec, len);
+  name[len] = '\0';
+  p = findprotocol(name);
+  if (p == NULL)
+    return NULL;
+  *window = p->maxwindow;
+  if (colon != NULL) {
+    *window = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || *window < 1 || *window > p->maxwindow)
+      return NULL;
+  }
+  return p;
+}
+
+/* the instance the by-value entry points of legacy.h drive */
+static const struct protocol *current;
+static void *currentstate;
+
+void useprotocol(const struct protocol *p, void *inst)
+{
+  current = p;
+  currentstate = inst;
+}
+
+/* called from layer 5, passed the message to be sent to other side */
+void A_output(struct msg message)
+{
+  current->A_output_bytes(currentstate, 0, message.data, 20);
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at A */
+void A_input(struct pkt packet)
+{
+  current->A_input(currentstate, &packet);
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at B */
+void B_input(struct pkt packet)
+{
+  current->B_input(currentstate, &packet);
+}
+
+/* called when A's timer goes off */
+void A_timerinterrupt(void)
+{
+  current->A_timerinterrupt(currentstate, 0);
+}
+
+void B_output(struct msg message)
+{
+  current->B_output(currentstate, message);
+}
+
+void B_timerinterrupt(void)
+{
+  current->B_timerinterrupt(currentstate);
+}
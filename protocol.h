@@ -0,0 +1,42 @@
+/* A transport protocol, as a table of its entry points.  create() makes
+   an instance that holds the state of both ends, and every other routine
+   works on the instance it is handed, so one program can run any of the
+   protocols, with any window, one after another.  The A routines and the
+   B routines of an instance touch separate state, so A and B may each run
+   on a thread of their own */
+struct protocol {
+  const char *name;
+  int maxwindow;                     /* largest window create() accepts */
+  double rtt;                        /* A's timeout, a round trip.  The pacer
+                                        spreads a window over it */
+  void *(*create)(int);              /* window.  Sets up A and B for nflows flows */
+  void (*destroy)(void *);
+  int (*A_output_bytes)(void *, int, const char *, int);  /* flow, data, length. 1 if accepted */
+  void (*A_input)(void *, const struct pkt *);  /* packet lent by the caller, */
+  void (*B_input)(void *, const struct pkt *);  /* valid for the call only */
+  void (*A_timerinterrupt)(void *, int);        /* flow whose timer went off */
+  int (*A_windowcount)(void *, int);  /* flow. packets sent and not yet ACKed */
+  int (*A_ready)(void *, int);        /* flow. 1 if A_output_bytes would take a message now */
+
+  /* checkpointing: each side writes its state through put, and reads it
+     back through get into an instance fresh from create() */
+  void (*A_save)(void *, void (*put)(const void *, int));
+  void (*A_restore)(void *, void (*get)(void *, int));
+  void (*B_save)(void *, void (*put)(const void *, int));
+  void (*B_restore)(void *, void (*get)(void *, int));
+
+  /* included for extension to bidirectional communication */
+  void (*B_output)(void *, struct msg);
+  void (*B_timerinterrupt)(void *);
+};
+
+#define BIDIRECTIONAL 0       /*  0 = A->B  1 =  A<->B */
+
+extern const struct protocol *const protocols[];  /* all of them, NULL at the end */
+
+/* the protocol called name, NULL if there is none */
+extern const struct protocol *findprotocol(const char *name);
+
+/* the protocol and window asked for by "name" or "name:window", the
+   protocol's largest window if none is given.  NULL if spec is no good */
+extern const struct protocol *parseprotocol(const char *spec, int *window);
@@ -0,0 +1,436 @@
+/* ******************************************************************
+   SHARED MEMORY RING DRIVER
+
+   Runs the protocol code in gbn.c or sr.c with A and B on separate cores,
+   exchanging packets through two single-producer single-consumer rings
+   (A->B and B->A) in one shared mapping.  There is no kernel on the data
+   path, so what is measured is the cost of the protocol processing
+   itself.  It replaces emulator.c and is linked the same way, with the
+   protocol picked by -a:
+
+       gcc -O2 -pthread -o shm shmdriver.c gbn.c sr.c protocol.c fec.c
+
+   Each ring keeps its producer index and its consumer index on cache
+   lines of their own.  The producer writes packets into slots and makes
+   them visible a batch at a time with one release store of head.  The
+   consumer reads everything published with one acquire load and hands
+   each packet to the protocol in place, then frees the whole batch with
+   one store of tail.  A full ring drops the packet, like a full queue.
+
+   By default B runs as a second thread, with -P as a forked process.
+   Timers are checked against the monotonic clock on every pass of each
+   side's loop, with one time unit mapped to -u microseconds.  A side
+   that finds nothing to do for a while yields its core.  With no
+   -d, A offers a new message whenever the last one was taken, which
+   keeps the window full.
+
+   Linux/POSIX only (mmap, pthreads, C11 atomics).
+   ********************************************************************* */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "emulator.h"
+#include "protocol.h"
+#include "legacy.h"
+
+int TRACE = 0;
+int mtu = 20;                     /* payload bytes per packet (-m) */
+int nflows = 1;                   /* flows sharing the rings (-f) */
+int nacks = 0;                    /* B sends no NACKs */
+int fec = 0;                      /* and A no parity */
+int rcvbuf = 0;                   /* and B takes every message at once */
+
+#define PKTHEADER ((int)offsetof(struct pkt, payload))  /* bytes of header on the wire */
+
+/* statistics updated by the protocol; each side only touches its own */
+int window_full;
+int total_ACKs_received;
+int packets_resent;
+int new_ACKs;
+int packets_received;
+int nacks_sent;
+int nack_resends;
+int parity_sent;
+int fec_recovered;
+int probes_sent;
+
+#define CACHELINE  64
+#define RINGSLOTS  1024           /* power of two */
+#define BATCH      32             /* packets per publish / consume */
+#define IDLESPINS  64             /* empty passes before a side yields its core */
+
+struct ring {
+  _Alignas(CACHELINE) atomic_ulong head;  /* slots published by the producer */
+  _Alignas(CACHELINE) atomic_ulong tail;  /* slots released by the consumer */
+  _Alignas(CACHELINE) unsigned long written;    /* producer only: slots filled */
+  unsigned long published;                      /* producer only: last value stored to head */
+  unsigned long tailseen;                       /* producer only: last value loaded from tail */
+  _Alignas(CACHELINE) unsigned long consumed;   /* consumer only: next slot to read */
+  _Alignas(CACHELINE) struct pkt slots[RINGSLOTS];
+};
+
+/* what each side owns.  Lives in the shared mapping so the report can be
+   made whichever way B runs */
+struct side {
+  _Alignas(CACHELINE) unsigned int seed;  /* rand_r state for the loss shim */
+  double *deadline;               /* per flow timer expiry in us, 0 if stopped */
+  double nextdeadline;            /* earliest of them, 0 if none */
+  long sent, lost, ringfull, received, timeouts;
+  double cpu;                     /* CPU seconds spent in the loop */
+  int window_full, packets_resent, new_ACKs, packets_received;
+  _Alignas(CACHELINE) atomic_long delivered;  /* messages delivered (B) */
+  atomic_int done;                /* set by A when the run is over */
+};
+
+struct shared {
+  struct ring ring[2];            /* ring[A] carries A->B, ring[B] carries B->A */
+  struct side side[2];
+};
+
+static struct shared *shm;
+
+static int nsimmax = 1000000;     /* number of msgs to send (-n) */
+static double lossprob = 0.0;     /* probability that a packet is dropped (-L) */
+static double lambda = 0.0;       /* time units between messages, 0 to keep A saturated (-d) */
+static double unit_us = 100.0;    /* microseconds of wall time per time unit (-u) */
+static int msgsize = 20;          /* bytes in each layer 5 message (-l) */
+static const struct protocol *proto; /* the protocol under test (-a) */
+static void *pstate;              /* made before B starts, each side uses its half */
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_s(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/********************** Rings ***********************/
+
+/* make every written slot visible to the consumer */
+static void ring_publish(struct ring *r)
+{
+  if (r->written != r->published) {
+    atomic_store_explicit(&r->head, r->written, memory_order_release);
+    r->published = r->written;
+  }
+}
+
+/* copy a packet into the next free slot; 0 if the ring is full */
+static int ring_put(struct ring *r, const struct pkt *packet)
+{
+  if (r->written - r->tailseen == RINGSLOTS) {
+    r->tailseen = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (r->written - r->tailseen == RINGSLOTS)
+      return 0;
+  }
+  memcpy(&r->slots[r->written & (RINGSLOTS - 1)], packet, PKTHEADER + packet->length);
+  r->written++;
+  if (r->written - r->published >= BATCH)
+    ring_publish(r);
+  return 1;
+}
+
+/* hand every published packet to entity AorB in place, then release the slots */
+static int ring_consume(struct ring *r, int AorB)
+{
+  unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+  unsigned long first = r->consumed;
+
+  while (r->consumed != head) {
+    if (AorB == A)
+      proto->A_input(pstate, &r->slots[r->consumed & (RINGSLOTS - 1)]);
+    else
+      proto->B_input(pstate, &r->slots[r->consumed & (RINGSLOTS - 1)]);
+    r->consumed++;
+  }
+  if (r->consumed != first)
+    atomic_store_explicit(&r->tail, r->consumed, memory_order_release);
+  return (int)(r->consumed - first);
+}
+
+/********************** Protocol-callable ROUTINES ***********************/
+
+void tolayer3(int AorB, struct pkt packet)
+{
+  tolayer3_ref(AorB, &packet);
+}
+
+void tolayer3_ref(int AorB, const struct pkt *packet)
+{
+  struct side *s = &shm->side[AorB];
+
+  s->sent++;
+  if (lossprob > 0.0 && rand_r(&s->seed) / (double)RAND_MAX < lossprob) {
+    s->lost++;
+    return;
+  }
+  if (!ring_put(&shm->ring[AorB], packet))
+    s->ringfull++;
+}
+
+void tolayer5(int AorB, const char datasent[20])
+{
+  tolayer5_bytes(AorB, 0, datasent, 20);
+}
+
+void tolayer5_bytes(int AorB, int flow, const char *datasent, int length)
+{
+  if (AorB == B)
+    atomic_fetch_add_explicit(&shm->side[B].delivered, 1, memory_order_relaxed);
+}
+
+int layer5_room(int flow)
+{
+  return INT_MAX;
+}
+
+static void findnextdeadline(struct side *s)
+{
+  int i;
+
+  s->nextdeadline = 0.0;
+  for (i = 0; i < nflows; i++)
+    if (s->deadline[i] > 0.0 && (s->nextdeadline == 0.0 || s->deadline[i] < s->nextdeadline))
+      s->nextdeadline = s->deadline[i];
+}
+
+void starttimer(int AorB, double increment)
+{
+  starttimer_flow(AorB, 0, increment);
+}
+
+void starttimer_flow(int AorB, int flow, double increment)
+{
+  struct side *s = &shm->side[AorB];
+
+  if (s->deadline[flow] > 0.0) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  s->deadline[flow] = now_us() + increment * unit_us;
+  if (s->nextdeadline == 0.0 || s->deadline[flow] < s->nextdeadline)
+    s->nextdeadline = s->deadline[flow];
+}
+
+void stoptimer(int AorB)
+{
+  stoptimer_flow(AorB, 0);
+}
+
+void stoptimer_flow(int AorB, int flow)
+{
+  struct side *s = &shm->side[AorB];
+
+  if (s->deadline[flow] == 0.0) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  if (s->deadline[flow] == s->nextdeadline) {
+    s->deadline[flow] = 0.0;
+    findnextdeadline(s);
+  }
+  else
+    s->deadline[flow] = 0.0;
+}
+
+/********************** Driver ***********************/
+
+/* fire every timer of side AorB that is due */
+static void firetimers(int AorB, double now)
+{
+  struct side *s = &shm->side[AorB];
+  int i;
+
+  if (s->nextdeadline == 0.0 || now < s->nextdeadline)
+    return;
+  for (i = 0; i < nflows; i++)
+    if (s->deadline[i] > 0.0 && s->deadline[i] <= now) {
+      s->deadline[i] = 0.0;
+      s->timeouts++;
+      if (AorB == A)
+        proto->A_timerinterrupt(pstate, i);
+      else
+        proto->B_timerinterrupt(pstate);
+    }
+  findnextdeadline(s);
+}
+
+static void *runside(void *arg)
+{
+  int AorB = (int)(long)arg, other = 1 - AorB;
+  struct side *s = &shm->side[AorB];
+  char *msgdata = malloc(msgsize + 1);
+  double now, start, nextarrival, lastprogress;
+  long accepted = 0, delivered;
+  int nsim = 0, n, idle = 0;
+
+  s->deadline = calloc(nflows, sizeof(double));
+  if (msgdata == NULL || s->deadline == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  start = cpu_s();
+  nextarrival = lastprogress = now_us();
+  while (!atomic_load_explicit(&shm->side[A].done, memory_order_relaxed)) {
+    now = now_us();
+    if (AorB == A && nsim < nsimmax && now >= nextarrival) {
+      memset(msgdata, 97 + nsim % 26, msgsize);
+      if (proto->A_output_bytes(pstate, nsim % nflows, msgdata, msgsize)) {
+        accepted++;
+        nsim++;
+      }
+      else if (lambda > 0.0)
+        nsim++;         /* paced messages are dropped at a full window, as in the emulator */
+      if (lambda > 0.0)
+        nextarrival = now + lambda * unit_us;
+    }
+    firetimers(AorB, now);
+    n = ring_consume(&shm->ring[other], AorB);
+    s->received += n;
+    ring_publish(&shm->ring[AorB]);
+    /* spin while there is work, but let the other side in when both
+       share a core */
+    if (n > 0)
+      idle = 0;
+    else if (++idle == IDLESPINS) {
+      sched_yield();
+      idle = 0;
+    }
+    if (AorB == A) {
+      if (n > 0)
+        lastprogress = now;
+      delivered = atomic_load_explicit(&shm->side[B].delivered, memory_order_relaxed);
+      if ((nsim >= nsimmax && delivered >= accepted) || now - lastprogress > 16000.0 * unit_us)
+        atomic_store_explicit(&s->done, 1, memory_order_relaxed);
+    }
+  }
+  s->cpu = cpu_s() - start;
+  s->window_full = window_full;
+  s->packets_resent = packets_resent;
+  s->new_ACKs = new_ACKs;
+  s->packets_received = packets_received;
+  return NULL;
+}
+
+static void report(const char *name, const struct side *s)
+{
+  long packets = s->sent + s->received;
+
+  printf("%s: sent %ld (%ld lost, %ld ring full), received %ld, timeouts %ld, cpu %.3f s, %.3f Mpps per core\n",
+         name, s->sent, s->lost, s->ringfull, s->received, s->timeouts, s->cpu,
+         s->cpu > 0.0 ? packets / s->cpu / 1e6 : 0.0);
+}
+
+static void usage(const char *prog)
+{
+  printf("usage: %s [-n msgs] [-L loss] [-d gap] [-u usec] [-f flows] [-m mtu] [-l length] [-P] [-T trace]\n", prog);
+  printf("       [-a protocol[:window]]\n");
+  printf("  -n  messages to deliver (default 1000000)\n");
+  printf("  -L  probability a packet is dropped in tolayer3 (default 0)\n");
+  printf("  -d  time units between layer 5 messages, 0 keeps A saturated (default 0)\n");
+  printf("  -u  microseconds of wall time per time unit (default 100)\n");
+  printf("  -f  number of flows (default 1)\n");
+  printf("  -m  payload bytes per packet, 1..%d (default 20)\n", MAXPAYLOAD);
+  printf("  -l  bytes per layer 5 message, 0..%d (default 20)\n", MAXMSGSIZE);
+  printf("  -P  run B as a separate process instead of a thread\n");
+  printf("  -a  sw, gbn (default) or sr, with a window of at most 6\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t thread;
+  pid_t pid = 0;
+  double start, elapsed;
+  long delivered;
+  int c, processes = 0, window;
+
+  proto = parseprotocol("gbn", &window);
+  while ((c = getopt(argc, argv, "n:L:d:u:f:m:l:PT:a:")) != -1) {
+    switch (c) {
+    case 'n': nsimmax = atoi(optarg); break;
+    case 'L': lossprob = atof(optarg); break;
+    case 'd': lambda = atof(optarg); break;
+    case 'u': unit_us = atof(optarg); break;
+    case 'f': nflows = atoi(optarg); break;
+    case 'm': mtu = atoi(optarg); break;
+    case 'l': msgsize = atoi(optarg); break;
+    case 'P': processes = 1; break;
+    case 'T': TRACE = atoi(optarg); break;
+    case 'a':
+      proto = parseprotocol(optarg, &window);
+      if (proto == NULL)
+        usage(argv[0]);
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nsimmax < 1 || nflows < 1 || mtu < 1 || mtu > MAXPAYLOAD || msgsize < 0
+      || msgsize > MAXMSGSIZE || lambda < 0.0 || unit_us <= 0.0)
+    usage(argv[0]);
+
+  shm = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  shm->side[A].seed = 9999;
+  shm->side[B].seed = 9998;
+  pstate = proto->create(window);
+  useprotocol(proto, pstate);
+
+  start = now_us();
+  if (processes) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      runside((void *)(long)B);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+  else if (pthread_create(&thread, NULL, runside, (void *)(long)B) != 0) {
+    perror("pthread_create");
+    exit(EXIT_FAILURE);
+  }
+  runside((void *)(long)A);
+  if (processes)
+    waitpid(pid, NULL, 0);
+  else
+    pthread_join(thread, NULL);
+  elapsed = now_us() - start;
+
+  delivered = atomic_load(&shm->side[B].delivered);
+  printf("shared memory ring run of %s, window %d (%s): %ld msgs delivered, %d flows, loss %.3f\n",
+         proto->name, window, processes ? "processes" : "threads", delivered, nflows, lossprob);
+  printf("number of messages refused due to full window:  %d \n", shm->side[A].window_full);
+  printf("number of packet resends by A:  %d \n", shm->side[A].packets_resent);
+  printf("number of correct packets received at B:  %d \n", shm->side[B].packets_received);
+  report("A", &shm->side[A]);
+  report("B", &shm->side[B]);
+  printf("elapsed wall time:  %.3f s, %.3f M messages per second, %.3f Mpps through the rings\n",
+         elapsed / 1e6, delivered / elapsed,
+         (shm->side[A].received + shm->side[B].received) / elapsed);
+  return EXIT_SUCCESS;
+}
@@ -1,7 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include "emulator.h"
+#include "protocol.h"
 #include "sr.h"
+#include "fec.h"
 
 /* ******************************************************************
    Selective Repeat protocol.  Adapted from J.F.Kurose
@@ -19,132 +23,311 @@
    - removed bidirectional GBN code and other code not used by prac.
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - B keeps packets that arrive ahead of a gap until it fills, and does
+   not ACK a corrupted packet, whose seqnum can not be trusted.  It used
+   to drop the first and ACK the second, and either stalled delivery
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
-                          MUST BE SET TO 6 when submitting assignment */
+                          MUST BE SET TO 6 when submitting assignment.
+                          An instance may be created with a smaller window */
 #define SEQSPACE 12     /* the min sequence space for SR must be at least 2*windowsize */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
    original checksum.  This procedure must generate a different checksum to the original if
-   the packet is corrupted.
+   the packet is corrupted.  The packet is read in place rather than copied.
 */
-int ComputeChecksum(struct pkt packet)
+static int ComputeChecksum_ref(const struct pkt *packet)
 {
   int checksum = 0;
   int i;
 
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ )
-    checksum += (int)(packet.payload[i]);
+  checksum = packet->seqnum;
+  checksum += packet->acknum;
+  checksum += packet->length;
+  checksum += packet->flags;
+  checksum += packet->flow;
+  for ( i=0; i<packet->length && i<MAXPAYLOAD; i++ )
+    checksum += (int)(packet->payload[i]);
 
   return checksum;
 }
 
-int IsCorrupted(struct pkt packet)
+static int IsCorrupted_ref(const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  if (packet->checksum == ComputeChecksum_ref(packet))
     return (0);
   else
     return (1);
 }
 
+/* one selective repeat connection per flow, both ends.  A and B keep to
+   their own half */
+struct sr {
+  int windowsize;                 /* packets in a window, 1..WINDOWSIZE */
+  int nacks;                      /* B sends NACKs */
+  int fec;                        /* data packets per parity packet, 0 for none */
+  int segment;                    /* payload bytes per data packet: mtu, less the
+                                     parity header with FEC so the parity fits too */
+  int rcvbuf;                     /* bytes B's layer 5 buffers per flow, 0 for no limit */
+  struct sender *senders;         /* A's state, indexed by flow */
+  struct receiver *receivers;     /* B's state, indexed by flow */
+};
+
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[SEQSPACE];
-static int acked[SEQSPACE];
-static int base;
-static int nextseqnum;
-static int timer_active;
+/* A keeps one of these for each flow */
+struct sender {
+  char *buffer;                   /* SEQSPACE packets, PKTSIZE(mtu) bytes each */
+  int acked[SEQSPACE];
+  int base;
+  int nextseqnum;
+  int timer_active;
+  char *pending;                  /* segments of the current message that did not fit in the window */
+  int pendingfirst, pendinglast;  /* unsent bytes are pending[pendingfirst..pendinglast-1] */
+  int pendingsize;                /* bytes allocated for pending */
+  struct fecsender fec;           /* parity of the new packets sent since the last one */
+  int rwnd;                       /* packets B last said it has room for */
+  int probing;                    /* the timer is probing a closed window */
+};
+
+/* the packet in slot i of the flow's window buffer */
+static struct pkt *A_slot(const struct sender *s, int i)
+{
+  return (struct pkt *)(s->buffer + i * PKTSIZE(mtu));
+}
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+/* number of packets sent but not yet slid out of the window */
+static int A_inflight(const struct sender *s)
 {
-  struct pkt sendpkt;
-  int i;
+  return (s->nextseqnum - s->base + SEQSPACE) % SEQSPACE;
+}
 
-  if (((nextseqnum - base + SEQSPACE) % SEQSPACE) < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+/* packets A may have in flight: its window, or fewer if B has less room */
+static int A_sendwindow(const struct sr *g, const struct sender *s)
+{
+  return s->rwnd < g->windowsize ? s->rwnd : g->windowsize;
+}
+
+/* put one segment of at most mtu bytes in the buffer and send it. eom marks the last segment */
+static void A_sendsegment(struct sr *g, int flow, const char *data, int length, int eom)
+{
+  struct sender *s = &g->senders[flow];
+  struct pkt *sendpkt, *parity;
+
+  /* build the packet in its buffer slot and transmit from there */
+  sendpkt = A_slot(s, s->nextseqnum % SEQSPACE);
+  sendpkt->seqnum = s->nextseqnum;
+  sendpkt->acknum = NOTINUSE;
+  sendpkt->length = length;
+  sendpkt->flags = eom ? PKT_EOM : 0;
+  sendpkt->flow = flow;
+  memcpy(sendpkt->payload, data, length);
+  sendpkt->checksum = ComputeChecksum_ref(sendpkt);
 
-    sendpkt.seqnum = nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ )
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+  s->acked[s->nextseqnum % SEQSPACE] = 0;
 
-    buffer[nextseqnum % SEQSPACE] = sendpkt;
-    acked[nextseqnum % SEQSPACE] = 0;
+  if (TRACE > 0)
+    printf("Sending packet %d to layer 3\n", sendpkt->seqnum);
+  tolayer3_ref(A, sendpkt);
 
+  /* every g->fec new packets, the parity of the group goes out behind them.
+     It is never ACKed or resent */
+  if (g->fec && (parity = fec_send(&s->fec, sendpkt, g->fec)) != NULL) {
+    parity->checksum = ComputeChecksum_ref(parity);
     if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3(A, sendpkt);
+      printf("Sending parity of packets %d.. to layer 3\n", parity->seqnum);
+    tolayer3_ref(A, parity);
+    parity_sent++;
+  }
 
-    if (!timer_active) {
-      starttimer(A, RTT);
-      timer_active = 1;
-    }
+  if (!s->timer_active) {
+    starttimer_flow(A, flow, RTT);
+    s->timer_active = 1;
+  }
 
-    nextseqnum = (nextseqnum + 1) % SEQSPACE;
+  s->nextseqnum = (s->nextseqnum + 1) % SEQSPACE;
+}
+
+/* send as many pending segments as the window allows */
+static void A_sendpending(struct sr *g, int flow)
+{
+  struct sender *s = &g->senders[flow];
+  int n;
+
+  while (s->pendingfirst < s->pendinglast && A_inflight(s) < A_sendwindow(g, s)) {
+    n = s->pendinglast - s->pendingfirst;
+    if (n > g->segment)
+      n = g->segment;
+    A_sendsegment(g, flow, &s->pending[s->pendingfirst], n, s->pendingfirst + n == s->pendinglast);
+    s->pendingfirst += n;
+  }
+}
+
+/* called from layer 5 (application layer), passed a message of any length up
+   to MAXMSGSIZE to be sent to the other side on the given flow.  The
+   message is cut into segments of mtu bytes.  Whatever does not fit in the
+   window waits in the pending buffer, so while it drains the window stays
+   full and further messages are dropped.  Returns 1 if the message was
+   accepted */
+static int A_output_bytes(void *inst, int flow, const char *data, int length)
+{
+  struct sr *g = inst;
+  struct sender *s = &g->senders[flow];
+  int n, sent;
+
+  if (A_inflight(s) < A_sendwindow(g, s) && length <= MAXMSGSIZE) {
+    if (TRACE > 1)
+      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+
+    /* send the leading segments straight from the caller's buffer */
+    sent = 0;
+    do {
+      n = length - sent;
+      if (n > g->segment)
+        n = g->segment;
+      A_sendsegment(g, flow, data + sent, n, sent + n == length);
+      sent += n;
+    } while (sent < length && A_inflight(s) < A_sendwindow(g, s));
+
+    /* keep the rest until ACKs open the window. The buffer is only
+       allocated for flows that send messages bigger than the window */
+    s->pendingfirst = 0;
+    s->pendinglast = length - sent;
+    if (s->pendinglast > s->pendingsize) {
+      s->pending = realloc(s->pending, s->pendinglast);
+      if (s->pending == NULL) {
+        printf("memory allocation for pending segments failed.");
+        exit(EXIT_FAILURE);
+      }
+      s->pendingsize = s->pendinglast;
+    }
+    if (s->pendinglast > 0)       /* pending is NULL until first needed */
+      memcpy(s->pending, data + sent, s->pendinglast);
+    return 1;
   }
   else {
     if (TRACE > 0)
       printf("----A: New message arrives, send window is full\n");
     window_full++;
+    return 0;
   }
 }
 
 
+/* ask B for its window, with a packet that carries no data */
+static void A_sendprobe(int flow)
+{
+  struct pkt probe;
+
+  probe.seqnum = NOTINUSE;
+  probe.acknum = NOTINUSE;
+  probe.length = 0;
+  probe.flags = PKT_PROBE;
+  probe.flow = flow;
+  probe.checksum = ComputeChecksum_ref(&probe);
+  if (TRACE > 0)
+    printf("----A: window is closed, send probe!\n");
+  tolayer3_ref(A, &probe);
+  probes_sent++;
+}
+
+/* act on the window B advertised.  Once it opens, what waits for it is
+   sent.  While it is closed with nothing in flight no ACK would come to
+   open it, so the timer probes for it instead */
+static void A_watchwindow(struct sr *g, int flow)
+{
+  struct sender *s = &g->senders[flow];
+
+  if (s->probing && s->rwnd > 0) {
+    stoptimer_flow(A, flow);
+    s->timer_active = 0;
+    s->probing = 0;
+  }
+  A_sendpending(g, flow);
+  if (s->rwnd == 0 && A_inflight(s) == 0 && !s->probing) {
+    starttimer_flow(A, flow, RTT);
+    s->timer_active = 1;
+    s->probing = 1;
+  }
+}
+
 /* called from layer 3, when a packet arrives for layer 4
    In this practical this will always be an ACK as B never sends data.
+   The packet is only borrowed for the duration of the call
 */
-void A_input(struct pkt packet)
+static void A_input(void *inst, const struct pkt *packet)
 {
-  int win_start = base;
-  int win_end = (base + WINDOWSIZE) % SEQSPACE;
+  struct sr *g = inst;
+  struct sender *s = &g->senders[packet->flow];
+  int win_start = s->base;
+  int win_end = (s->base + g->windowsize) % SEQSPACE;
   int in_window = 0;
-  int ack = packet.acknum;
+  int ack = packet->acknum;
+  int nack = packet->seqnum;
 
-  if (!IsCorrupted(packet)) {
+  if (!IsCorrupted_ref(packet)) {
     if (TRACE > 0)
       printf("----A: uncorrupted ACK %d is received\n", ack);
     total_ACKs_received++;
+    if (packet->flags & PKT_RWND)
+      memcpy(&s->rwnd, packet->payload, sizeof s->rwnd);
 
     if (win_start < win_end)
       in_window = (ack >= win_start && ack < win_end);
     else
       in_window = (ack >= win_start || ack < win_end);
 
-    if (in_window && !acked[ack % SEQSPACE]) {
-      acked[ack % SEQSPACE] = 1;
+    if (in_window && !s->acked[ack % SEQSPACE]) {
+      s->acked[ack % SEQSPACE] = 1;
       new_ACKs++;
       
       if (TRACE > 0)
         printf("----A: ACK %d is not a duplicate\n", ack);
       
-      stoptimer(A);
+      stoptimer_flow(A, packet->flow);
       
-      while (acked[base % SEQSPACE]) {
-        acked[base % SEQSPACE] = 0;
-        base = (base + 1) % SEQSPACE;
+      while (s->acked[s->base % SEQSPACE]) {
+        s->acked[s->base % SEQSPACE] = 0;
+        s->base = (s->base + 1) % SEQSPACE;
       }
       
-      if (base != nextseqnum) {
-        starttimer(A, RTT);
-        timer_active = 1;
+      if (s->base != s->nextseqnum) {
+        starttimer_flow(A, packet->flow, RTT);
+        s->timer_active = 1;
       } else {
-        timer_active = 0;
+        s->timer_active = 0;
       }
+
+      /* the window has slid, continue with the current message */
+      A_sendpending(g, packet->flow);
     }
-    else if (in_window && acked[ack % SEQSPACE]) {
+    else if (in_window && s->acked[ack % SEQSPACE]) {
       if (TRACE > 0)
         printf("----A: duplicate ACK received, do nothing!\n");
     }
+
+    /* a NACK names a packet B is missing.  Resend it now rather than
+       when the timer goes off, and let the timer count from here */
+    if ((packet->flags & PKT_NACK) && nack >= 0 && nack < SEQSPACE
+        && (nack - s->base + SEQSPACE) % SEQSPACE < A_inflight(s) && !s->acked[nack]) {
+      if (TRACE > 0)
+        printf("----A: NACK %d is received, resend packet!\n", nack);
+      tolayer3_ref(A, A_slot(s, nack));
+      packets_resent++;
+      nack_resends++;
+      if (s->timer_active)
+        stoptimer_flow(A, packet->flow);
+      starttimer_flow(A, packet->flow, RTT);
+      s->timer_active = 1;
+    }
+
+    if (packet->flags & PKT_RWND)
+      A_watchwindow(g, packet->flow);
   }
   else {
     if (TRACE > 0)
@@ -152,51 +335,136 @@ void A_input(struct pkt packet)
   }
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt(void)
+/* called when the timer of one of A's flows goes off */
+static void A_timerinterrupt(void *inst, int flow)
 {
+  struct sr *g = inst;
+  struct sender *s = &g->senders[flow];
   int i;
   
-  if (base == nextseqnum) {
-    timer_active = 0;
+  if (s->probing) {
+    A_sendprobe(flow);
+    starttimer_flow(A, flow, RTT);
+    return;
+  }
+  if (s->base == s->nextseqnum) {
+    s->timer_active = 0;
     return;
   }
   
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
   
-  for (i = 0; i < WINDOWSIZE; i++) {
-    int seq = (base + i) % SEQSPACE;
-    if (seq != nextseqnum && !acked[seq % SEQSPACE]) {
+  for (i = 0; i < g->windowsize; i++) {
+    int seq = (s->base + i) % SEQSPACE;
+    if (seq != s->nextseqnum && !s->acked[seq % SEQSPACE]) {
       if (TRACE > 0)
         printf("---A: resending packet %d\n", seq);
       
-      tolayer3(A, buffer[seq % SEQSPACE]);
+      tolayer3_ref(A, A_slot(s, seq % SEQSPACE));
       packets_resent++;
       
-      starttimer(A, RTT);
-      timer_active = 1;
+      starttimer_flow(A, flow, RTT);
+      s->timer_active = 1;
       return;
     }
   }
   
-  timer_active = 0;
+  s->timer_active = 0;
 }
 
 
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+static void A_init(struct sr *g)
 {
-  int i;
-  
-  base = 0;
-  nextseqnum = 0;
-  timer_active = 0;
-  
-  for (i = 0; i < SEQSPACE; i++) {
-    acked[i] = 0;
+  int flow;
+
+  /* calloc leaves every flow with base 0, nextseqnum 0, no timer
+     and nothing acked */
+  g->senders = calloc(nflows, sizeof(struct sender));
+  if (g->senders == NULL) {
+    printf("memory allocation for sender state failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (flow = 0; flow < nflows; flow++) {
+    g->senders[flow].rwnd = WINDOWSIZE;  /* until B says otherwise */
+    g->senders[flow].buffer = malloc(SEQSPACE * PKTSIZE(mtu));
+    if (g->senders[flow].buffer == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/* packets of the flow sent and not yet slid out of the window, for the
+   emulator's sampler */
+static int A_windowcount(void *inst, int flow)
+{
+  struct sr *g = inst;
+
+  return A_inflight(&g->senders[flow]);
+}
+
+/* 1 if the flow's window has room, so that A_output_bytes would take a
+   message rather than drop it */
+static int A_ready(void *inst, int flow)
+{
+  struct sr *g = inst;
+
+  return A_inflight(&g->senders[flow]) < A_sendwindow(g, &g->senders[flow]);
+}
+
+/* write A's windows and any pending segments, for a snapshot */
+static void A_save(void *inst, void (*put)(const void *, int))
+{
+  struct sr *g = inst;
+  struct sender *s;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    s = &g->senders[flow];
+    put(s, sizeof(struct sender));
+    put(s->buffer, SEQSPACE * PKTSIZE(mtu));
+    if (s->pendinglast > s->pendingfirst)
+      put(&s->pending[s->pendingfirst], s->pendinglast - s->pendingfirst);
+  }
+}
+
+/* read back what A_save wrote */
+static void A_restore(void *inst, void (*get)(void *, int))
+{
+  struct sr *g = inst;
+  struct sender *s;
+  struct fecsender fec;
+  char *pending, *buffer;
+  int flow, size;
+
+  for (flow = 0; flow < nflows; flow++) {
+    s = &g->senders[flow];
+    pending = s->pending;       /* the pointers in the snapshot are stale */
+    size = s->pendingsize;
+    buffer = s->buffer;
+    fec = s->fec;
+    get(s, sizeof(struct sender));
+    s->buffer = buffer;
+    s->fec = fec;
+    get(s->buffer, SEQSPACE * PKTSIZE(mtu));
+    s->pendinglast -= s->pendingfirst;
+    s->pendingfirst = 0;
+    if (s->pendinglast > size) {
+      pending = realloc(pending, s->pendinglast);
+      if (pending == NULL) {
+        printf("memory allocation for pending segments failed.");
+        exit(EXIT_FAILURE);
+      }
+      size = s->pendinglast;
+    }
+    s->pending = pending;
+    s->pendingsize = size;
+    if (s->pendinglast > 0)
+      get(s->pending, s->pendinglast);
   }
 }
 
@@ -204,44 +472,247 @@ void A_init(void)
 
 /********* Receiver (B) variables and procedures ************/
 
-static int rcv_base;
+/* B keeps one of these for each flow */
+struct receiver {
+  int rcv_base;
+  char *rcvbuffer;                /* SEQSPACE packets that arrived ahead of rcv_base,
+                                     PKTSIZE(mtu) bytes each */
+  int received[SEQSPACE];         /* which rcvbuffer slots hold a packet */
+  int nacked;                     /* 1 once a NACK has named rcv_base */
+  char *reassembly;               /* segments of the message being received */
+  int reassemblylen;              /* bytes of it received so far */
+  int reassemblysize;             /* bytes allocated for reassembly */
+  struct fecreceiver fec;         /* the packets of the current parity groups */
+};
+
+/* the packet in slot i of the flow's receive buffer */
+static struct pkt *B_slot(const struct receiver *r, int i)
+{
+  return (struct pkt *)(r->rcvbuffer + i * PKTSIZE(mtu));
+}
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+/* add an in-order segment to the message being reassembled and hand the
+   message to layer 5 once it is complete.  A single-segment message is
+   handed up straight from the packet */
+static void B_deliver(struct sr *g, const struct pkt *packet)
 {
+  struct receiver *r = &g->receivers[packet->flow];
+  int len = r->reassemblylen + packet->length;
+
+  packets_received++;
+  if ((packet->flags & PKT_EOM) && r->reassemblylen == 0)
+    tolayer5_bytes(B, packet->flow, packet->payload, packet->length);
+  else if (len <= MAXMSGSIZE) {
+    if (len > r->reassemblysize) {
+      r->reassembly = realloc(r->reassembly, len);
+      if (r->reassembly == NULL) {
+        printf("memory allocation for reassembly failed.");
+        exit(EXIT_FAILURE);
+      }
+      r->reassemblysize = len;
+    }
+    memcpy(&r->reassembly[r->reassemblylen], packet->payload, packet->length);
+    r->reassemblylen = len;
+    if (packet->flags & PKT_EOM) {
+      tolayer5_bytes(B, packet->flow, r->reassembly, r->reassemblylen);
+      r->reassemblylen = 0;
+    }
+  }
+}
+
+/* the packets B's layer 5 buffer has room for, after the message being
+   reassembled */
+static int B_window(const struct receiver *r, int flow)
+{
+  int room = layer5_room(flow) - r->reassemblylen;
+
+  return room > 0 ? room / mtu : 0;
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at B.
+   The packet is only borrowed for the duration of the call */
+static void B_input(void *inst, const struct pkt *packet)
+{
+  struct sr *g = inst;
+  struct receiver *r;
   struct pkt sendpkt;
-  int i;
+  const struct pkt *rebuilt;
+  int seq, window, gap = 0;
   
-  if (!IsCorrupted(packet)) {
-    if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n", packet.seqnum);
-    
-    if (packet.seqnum == rcv_base) {
-      packets_received++;
-      tolayer5(B, packet.payload);
-      rcv_base = (rcv_base + 1) % SEQSPACE;
+  r = &g->receivers[packet->flow];
+
+  /* a parity packet is not ACKed, but may stand in for a lost packet of
+     its group, which then arrives as if it had come through */
+  if (packet->flags & PKT_PARITY) {
+    if (!IsCorrupted_ref(packet) && (rebuilt = fec_repair(&r->fec, packet)) != NULL
+        && !IsCorrupted_ref(rebuilt)) {
+      if (TRACE > 0)
+        printf("----B: packet %d rebuilt from parity\n", rebuilt->seqnum);
+      fec_recovered++;
+      B_input(g, rebuilt);
+    }
+    fec_endgroup(&r->fec, packet);
+    return;
+  }
+  if (IsCorrupted_ref(packet)) {
+    /* the seqnum can not be trusted, so there is nothing to ACK.  With
+       NACKs the packet is taken to be the one B waits on, and the ACK
+       part only repeats one for a packet already delivered */
+    if (!g->nacks || r->nacked) {
+      if (TRACE > 0)
+        printf("----B: packet corrupted, do nothing!\n");
+      return;
     }
-  } else {
+    seq = (r->rcv_base + SEQSPACE - 1) % SEQSPACE;
+    gap = 1;
+  }
+  else if (packet->flags & PKT_PROBE) {
+    /* only the window is wanted.  The ACK part repeats one for a packet
+       already delivered */
+    seq = (r->rcv_base + SEQSPACE - 1) % SEQSPACE;
+  }
+  else {
     if (TRACE > 0)
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
+      printf("----B: packet %d is correctly received, send ACK!\n", packet->seqnum);
+    if (g->fec)
+      fec_receive(&r->fec, packet);
+
+    /* packets inside the receive window are delivered in order. Those that
+       arrive ahead of a gap wait in rcvbuffer, since the sender will not
+       resend anything it holds an ACK for. Anything else is a duplicate of
+       a delivered packet whose ACK was lost, and is only ACKed again */
+    seq = packet->seqnum;
+    if ((seq - r->rcv_base + SEQSPACE) % SEQSPACE < g->windowsize) {
+      /* with a bounded layer 5 buffer a packet is only taken if, with a
+         full segment for each packet ahead of it, it fits.  Then whatever
+         waits in rcvbuffer fits when its turn comes.  A packet that does
+         not is left unACKed, and the window in the ACK holds A back */
+      if (g->rcvbuf && !r->received[seq]
+          && r->reassemblylen + (seq - r->rcv_base + SEQSPACE) % SEQSPACE * mtu + packet->length
+             > layer5_room(packet->flow)) {
+        if (TRACE > 0)
+          printf("----B: no room for packet %d, refuse it!\n", seq);
+        seq = (r->rcv_base + SEQSPACE - 1) % SEQSPACE;
+      }
+      else if (seq == r->rcv_base) {
+        B_deliver(g, packet);
+        r->rcv_base = (r->rcv_base + 1) % SEQSPACE;
+        while (r->received[r->rcv_base]) {
+          B_deliver(g, B_slot(r, r->rcv_base));
+          r->received[r->rcv_base] = 0;
+          r->rcv_base = (r->rcv_base + 1) % SEQSPACE;
+        }
+        r->nacked = 0;
+      }
+      else {
+        if (!r->received[seq]) {
+          memcpy(B_slot(r, seq), packet, offsetof(struct pkt, payload) + packet->length);
+          r->received[seq] = 1;
+        }
+        gap = 1;
+      }
+    }
   }
   
   sendpkt.seqnum = NOTINUSE;
-  sendpkt.acknum = packet.seqnum;
-  
-  for (i = 0; i < 20; i++)
-    sendpkt.payload[i] = '0';
+  sendpkt.acknum = seq;
+  sendpkt.length = 0;
+  sendpkt.flags = 0;
+
+  /* name the packet at the gap, once only, so that the rest of a window
+     arriving behind a loss does not become a burst of NACKs */
+  if (gap && g->nacks && !r->nacked) {
+    if (TRACE > 0)
+      printf("----B: send NACK %d!\n", r->rcv_base);
+    sendpkt.seqnum = r->rcv_base;
+    sendpkt.flags = PKT_NACK;
+    r->nacked = 1;
+    nacks_sent++;
+  }
+  if (g->rcvbuf) {
+    window = B_window(r, packet->flow);
+    memcpy(sendpkt.payload, &window, sizeof window);
+    sendpkt.length = sizeof window;
+    sendpkt.flags |= PKT_RWND;
+  }
+  sendpkt.flow = packet->flow;
   
-  sendpkt.checksum = ComputeChecksum(sendpkt);
+  sendpkt.checksum = ComputeChecksum_ref(&sendpkt);
   
-  tolayer3(B, sendpkt);
+  tolayer3_ref(B, &sendpkt);
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+static void B_init(struct sr *g)
 {
-  rcv_base = 0;
+  int flow;
+
+  /* calloc leaves every flow with rcv_base 0 and an empty rcvbuffer */
+  g->receivers = calloc(nflows, sizeof(struct receiver));
+  if (g->receivers == NULL) {
+    printf("memory allocation for receiver state failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (flow = 0; flow < nflows; flow++) {
+    g->receivers[flow].rcvbuffer = malloc(SEQSPACE * PKTSIZE(mtu));
+    if (g->receivers[flow].rcvbuffer == NULL) {
+      printf("memory allocation for receiver state failed.");
+      exit(EXIT_FAILURE);
+    }
+    if (g->fec)
+      fec_initreceiver(&g->receivers[flow].fec, SEQSPACE);
+  }
+}
+
+/* write B's state and any partly reassembled messages, for a snapshot */
+static void B_save(void *inst, void (*put)(const void *, int))
+{
+  struct sr *g = inst;
+  struct receiver *r;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    r = &g->receivers[flow];
+    put(r, sizeof(struct receiver));
+    put(r->rcvbuffer, SEQSPACE * PKTSIZE(mtu));
+    if (r->reassemblylen > 0)
+      put(r->reassembly, r->reassemblylen);
+  }
+}
+
+/* read back what B_save wrote */
+static void B_restore(void *inst, void (*get)(void *, int))
+{
+  struct sr *g = inst;
+  struct receiver *r;
+  struct fecreceiver fec;
+  char *reassembly, *rcvbuffer;
+  int flow, size;
+
+  for (flow = 0; flow < nflows; flow++) {
+    r = &g->receivers[flow];
+    reassembly = r->reassembly;  /* the pointers in the snapshot are stale */
+    size = r->reassemblysize;
+    rcvbuffer = r->rcvbuffer;
+    fec = r->fec;
+    get(r, sizeof(struct receiver));
+    r->rcvbuffer = rcvbuffer;
+    r->fec = fec;
+    get(r->rcvbuffer, SEQSPACE * PKTSIZE(mtu));
+    if (r->reassemblylen > size) {
+      reassembly = realloc(reassembly, r->reassemblylen);
+      if (reassembly == NULL) {
+        printf("memory allocation for reassembly failed.");
+        exit(EXIT_FAILURE);
+      }
+      size = r->reassemblylen;
+    }
+    r->reassembly = reassembly;
+    r->reassemblysize = size;
+    if (r->reassemblylen > 0)
+      get(r->reassembly, r->reassemblylen);
+  }
 }
 
 /******************************************************************************
@@ -249,11 +720,62 @@ void B_init(void)
  *****************************************************************************/
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)
+static void B_output(void *inst, struct msg message)
 {
 }
 
 /* called when B's timer goes off */
-void B_timerinterrupt(void)
+static void B_timerinterrupt(void *inst)
+{
+}
+
+
+
+/********* The instance ************/
+
+/* both ends of a connection for each of the nflows flows, with windows of
+   at most WINDOWSIZE packets */
+static void *create(int windowsize)
+{
+  struct sr *g;
+
+  g = calloc(1, sizeof(struct sr));
+  if (g == NULL) {
+    printf("memory allocation for protocol instance failed.");
+    exit(EXIT_FAILURE);
+  }
+  g->windowsize = windowsize;
+  g->nacks = nacks;
+  g->fec = fec;
+  g->segment = fec ? mtu - FECHEADER(fec) : mtu;
+  g->rcvbuf = rcvbuf;
+  A_init(g);
+  B_init(g);
+  return g;
+}
+
+static void destroy(void *inst)
 {
+  struct sr *g = inst;
+  int flow;
+
+  for (flow = 0; flow < nflows; flow++) {
+    free(g->senders[flow].buffer);
+    free(g->senders[flow].pending);
+    fec_freesender(&g->senders[flow].fec);
+    free(g->receivers[flow].rcvbuffer);
+    free(g->receivers[flow].reassembly);
+    if (g->fec)
+      fec_freereceiver(&g->receivers[flow].fec);
+  }
+  free(g->senders);
+  free(g->receivers);
+  free(g);
 }
+
+const struct protocol sr_protocol = {
+  "sr", WINDOWSIZE, RTT, create, destroy,
+  A_output_bytes, A_input, B_input, A_timerinterrupt, A_windowcount, A_ready,
+  A_save, A_restore, B_save, B_restore,
+  B_output, B_timerinterrupt
+};
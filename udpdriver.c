@@ -0,0 +1,487 @@
+/* ******************************************************************
+   UDP LOOPBACK DRIVER
+
+   Runs the protocol code in gbn.c or sr.c over real kernel sockets
+   instead of the emulated network, to measure wall-clock throughput and
+   latency.  It replaces emulator.c and is linked the same way, with the
+   protocol picked by -P:
+
+       gcc -O2 -o udp udpdriver.c gbn.c sr.c protocol.c fec.c
+
+   A and B each own a UDP socket bound to 127.0.0.1 and connected to the
+   other.  One epoll loop waits on both sockets, on a timerfd per running
+   protocol timer, and on a timerfd that paces the layer 5 arrivals.
+
+   One emulator time unit is mapped to -u microseconds of wall time, so
+   the RTT of 16.0 in the protocols becomes 16 ms by default.  Loss and
+   corruption can be injected in tolayer3 exactly as the emulator does.
+
+   Linux only (epoll, timerfd).
+   ********************************************************************* */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "emulator.h"
+#include "protocol.h"
+#include "legacy.h"
+#include "fec.h"
+
+int TRACE = 0;
+int mtu = 20;                     /* payload bytes per packet (-m) */
+int nflows = 1;                   /* flows sharing the sockets (-f) */
+int nacks = 0;                    /* B sends NACKs (-N) */
+int fec = 0;                      /* packets per parity packet (-F) */
+int rcvbuf = 0;                   /* B takes every message at once */
+
+#define PKTHEADER ((int)offsetof(struct pkt, payload))  /* bytes of header on the wire */
+
+/* statistics updated by the protocol */
+int window_full;
+int total_ACKs_received;
+int packets_resent;
+int new_ACKs;
+int packets_received;
+int nacks_sent;
+int nack_resends;
+int parity_sent;
+int fec_recovered;
+int probes_sent;
+
+/* epoll tokens: what woke us up */
+#define  EV_SOCKET       0
+#define  EV_TIMER        1
+#define  EV_ARRIVAL      2
+#define  TOKEN(kind, AorB, flow) ((unsigned long)(kind) | (unsigned long)(AorB) << 2 | (unsigned long)(flow) << 3)
+
+static int sock[2];               /* UDP socket of A and of B */
+static int *timerfd;              /* per flow timer of A and B, indexed AorB*nflows + flow, -1 if not made yet */
+static int *timerarmed;
+static int arrivalfd;             /* paces layer 5 arrivals */
+static int epfd;
+
+static int nsim = 0;              /* number of messages from 5 to 4 so far */
+static int nsimmax = 1000;        /* number of msgs to generate, then stop (-n) */
+static double lossprob = 0.0;     /* probability that a packet is dropped (-L) */
+static double corruptprob = 0.0;  /* probability that a packet is corrupted (-C) */
+static double lambda = 1.0;       /* average time units between messages (-d) */
+static double unit_us = 1000.0;   /* microseconds of wall time per time unit (-u) */
+static int msgsize = 20;          /* bytes in each layer 5 message (-l) */
+static char *msgdata;
+static const struct protocol *proto; /* the protocol under test (-P) */
+static void *pstate;
+
+static int ntolayer3, nlost, ncorrupt;
+static int accepted, delivered;
+static long bytes_delivered;
+
+/* accept time of each accepted, undelivered message, one ring per flow,
+   so that in-order delivery can be timed without stamping the payload */
+struct flowtimes {
+  double *t;
+  int first, count, size;
+};
+static struct flowtimes *accepttimes;
+static double *latencies;         /* one per delivered message, microseconds */
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double uniform(void)
+{
+  return rand() / (double)RAND_MAX;
+}
+
+static void fail(const char *what)
+{
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+/* arm timerfd fd to fire once after the given number of time units, or disarm it if 0 */
+static void armtimer(int fd, double units)
+{
+  struct itimerspec its;
+  double ns = units * unit_us * 1e3;
+
+  memset(&its, 0, sizeof(its));
+  if (units > 0.0) {
+    if (ns < 1.0)
+      ns = 1.0;
+    its.it_value.tv_sec = (time_t)(ns / 1e9);
+    its.it_value.tv_nsec = (long)(ns - its.it_value.tv_sec * 1e9);
+  }
+  if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    fail("timerfd_settime");
+}
+
+static void watch(int fd, unsigned long token)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = token;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    fail("epoll_ctl");
+}
+
+/********************** Protocol-callable ROUTINES ***********************/
+
+void tolayer3(int AorB, struct pkt packet)
+{
+  tolayer3_ref(AorB, &packet);
+}
+
+void tolayer3_ref(int AorB, const struct pkt *packet)
+{
+  struct pkt copy;
+  const struct pkt *out = packet;
+  double x;
+
+  ntolayer3++;
+  if (uniform() < lossprob) {
+    nlost++;
+    if (TRACE > 0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+  /* corrupt a copy the way the emulator does, the sender's window stays intact */
+  if (corruptprob > 0.0 && uniform() < corruptprob) {
+    ncorrupt++;
+    memcpy(&copy, packet, PKTHEADER + packet->length);
+    if ((x = uniform()) < .75 && copy.length > 0)
+      copy.payload[0] = 'Z';
+    else if (x < .875)
+      copy.seqnum = 999999;
+    else
+      copy.acknum = 999999;
+    out = &copy;
+    if (TRACE > 0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+  if (send(sock[AorB], out, PKTHEADER + out->length, 0) < 0 && errno != ECONNREFUSED) {
+    /* a full socket buffer is just more loss */
+    nlost++;
+    if (errno != EAGAIN && errno != ENOBUFS)
+      fail("send");
+  }
+}
+
+void tolayer5(int AorB, const char datasent[20])
+{
+  tolayer5_bytes(AorB, 0, datasent, 20);
+}
+
+void tolayer5_bytes(int AorB, int flow, const char *datasent, int length)
+{
+  struct flowtimes *ft = &accepttimes[flow];
+
+  if (AorB != B)
+    return;
+  delivered++;
+  bytes_delivered += length;
+  if (ft->count > 0) {
+    latencies[delivered - 1] = now_us() - ft->t[ft->first];
+    ft->first = (ft->first + 1) % ft->size;
+    ft->count--;
+  }
+}
+
+int layer5_room(int flow)
+{
+  return INT_MAX;
+}
+
+void starttimer(int AorB, double increment)
+{
+  starttimer_flow(AorB, 0, increment);
+}
+
+void starttimer_flow(int AorB, int flow, double increment)
+{
+  int i = AorB*nflows + flow;
+
+  if (timerarmed[i]) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  if (timerfd[i] < 0) {
+    timerfd[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfd[i] < 0)
+      fail("timerfd_create");
+    watch(timerfd[i], TOKEN(EV_TIMER, AorB, flow));
+  }
+  armtimer(timerfd[i], increment);
+  timerarmed[i] = 1;
+}
+
+void stoptimer(int AorB)
+{
+  stoptimer_flow(AorB, 0);
+}
+
+void stoptimer_flow(int AorB, int flow)
+{
+  int i = AorB*nflows + flow;
+
+  if (!timerarmed[i]) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  armtimer(timerfd[i], 0.0);
+  timerarmed[i] = 0;
+}
+
+/********************** Driver ***********************/
+
+static void recordaccept(int flow)
+{
+  struct flowtimes *ft = &accepttimes[flow];
+  double *grown;
+  int i;
+
+  if (ft->count == ft->size) {
+    grown = malloc((ft->size ? 2*ft->size : 16) * sizeof(double));
+    if (grown == NULL)
+      fail("malloc");
+    for (i = 0; i < ft->count; i++)
+      grown[i] = ft->t[(ft->first + i) % ft->size];
+    free(ft->t);
+    ft->t = grown;
+    ft->first = 0;
+    ft->size = ft->size ? 2*ft->size : 16;
+  }
+  ft->t[(ft->first + ft->count) % ft->size] = now_us();
+  ft->count++;
+}
+
+/* hand the next message to A; the flows take turns */
+static void arrival(void)
+{
+  int flow = nsim % nflows;
+
+  memset(msgdata, 97 + nsim % 26, msgsize);
+  nsim++;
+  if (proto->A_output_bytes(pstate, flow, msgdata, msgsize)) {
+    accepted++;
+    recordaccept(flow);
+  }
+  if (nsim < nsimmax)
+    armtimer(arrivalfd, lambda * uniform() * 2);  /* uniform on [0,2*lambda] as in the emulator */
+}
+
+/* drain every datagram waiting on the socket of AorB */
+static void receive(int AorB)
+{
+  struct pkt packet;
+  ssize_t n;
+
+  while ((n = recv(sock[AorB], &packet, sizeof(packet), 0)) >= 0) {
+    if (n < PKTHEADER || packet.length < 0 || packet.length > n - PKTHEADER
+        || packet.flow < 0 || packet.flow >= nflows)
+      continue;
+    if (AorB == A)
+      proto->A_input(pstate, &packet);
+    else
+      proto->B_input(pstate, &packet);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+    fail("recv");
+}
+
+static void makesockets(void)
+{
+  struct sockaddr_in addr[2];
+  socklen_t len;
+  int i, size = 4 << 20;
+
+  for (i = A; i <= B; i++) {
+    sock[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock[i] < 0)
+      fail("socket");
+    setsockopt(sock[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    memset(&addr[i], 0, sizeof(addr[i]));
+    addr[i].sin_family = AF_INET;
+    addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr[i].sin_port = 0;
+    if (bind(sock[i], (struct sockaddr *)&addr[i], sizeof(addr[i])) < 0)
+      fail("bind");
+    len = sizeof(addr[i]);
+    if (getsockname(sock[i], (struct sockaddr *)&addr[i], &len) < 0)
+      fail("getsockname");
+  }
+  if (connect(sock[A], (struct sockaddr *)&addr[B], sizeof(addr[B])) < 0 ||
+      connect(sock[B], (struct sockaddr *)&addr[A], sizeof(addr[A])) < 0)
+    fail("connect");
+}
+
+static int cmpdouble(const void *p, const void *q)
+{
+  double x = *(const double *)p, y = *(const double *)q;
+
+  return (x > y) - (x < y);
+}
+
+static void usage(const char *prog)
+{
+  printf("usage: %s [-n msgs] [-L loss] [-C corrupt] [-d mean gap] [-u usec] [-f flows] [-m mtu] [-l length] [-T trace]\n", prog);
+  printf("       [-P protocol[:window]] [-N] [-F k]\n");
+  printf("  -n  messages to send (default 1000)\n");
+  printf("  -L  probability a packet is dropped in tolayer3 (default 0)\n");
+  printf("  -C  probability a packet is corrupted in tolayer3 (default 0)\n");
+  printf("  -d  average time units between layer 5 messages (default 1)\n");
+  printf("  -u  microseconds of wall time per time unit (default 1000)\n");
+  printf("  -f  number of flows (default 1)\n");
+  printf("  -m  payload bytes per packet, 1..%d (default 20)\n", MAXPAYLOAD);
+  printf("  -l  bytes per layer 5 message, 0..%d (default 20)\n", MAXMSGSIZE);
+  printf("  -P  sw, gbn (default) or sr, with a window of at most 6\n");
+  printf("  -N  B sends a NACK for a missing packet, once per gap\n");
+  printf("  -F  A sends the XOR parity of every k new packets, 1..%d.  Data goes in\n", MAXFEC);
+  printf("      segments of mtu - %d - 4k bytes, so mtu must be more than %d + 4k\n", FECHEADER(0), FECHEADER(0));
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  struct epoll_event evs[64];
+  unsigned long token;
+  uint64_t expirations;
+  double start, elapsed, idle_since, sum;
+  int c, i, n, kind, AorB, flow, window;
+
+  proto = parseprotocol("gbn", &window);
+  while ((c = getopt(argc, argv, "n:L:C:d:u:f:m:l:T:P:NF:")) != -1) {
+    switch (c) {
+    case 'n': nsimmax = atoi(optarg); break;
+    case 'L': lossprob = atof(optarg); break;
+    case 'C': corruptprob = atof(optarg); break;
+    case 'd': lambda = atof(optarg); break;
+    case 'u': unit_us = atof(optarg); break;
+    case 'f': nflows = atoi(optarg); break;
+    case 'm': mtu = atoi(optarg); break;
+    case 'l': msgsize = atoi(optarg); break;
+    case 'T': TRACE = atoi(optarg); break;
+    case 'N': nacks = 1; break;
+    case 'F': fec = atoi(optarg); break;
+    case 'P':
+      proto = parseprotocol(optarg, &window);
+      if (proto == NULL)
+        usage(argv[0]);
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nsimmax < 1 || nflows < 1 || mtu < 1 || mtu > MAXPAYLOAD || msgsize < 0
+      || msgsize > MAXMSGSIZE || lambda <= 0.0 || unit_us <= 0.0
+      || fec < 0 || fec > MAXFEC || (fec && mtu <= FECHEADER(fec)))
+    usage(argv[0]);
+
+  srand(9999);
+  msgdata = malloc(msgsize + 1);
+  latencies = malloc(nsimmax * sizeof(double));
+  accepttimes = calloc(nflows, sizeof(struct flowtimes));
+  timerfd = malloc(2 * nflows * sizeof(int));
+  timerarmed = calloc(2 * nflows, sizeof(int));
+  if (msgdata == NULL || latencies == NULL || accepttimes == NULL || timerfd == NULL || timerarmed == NULL)
+    fail("malloc");
+  for (i = 0; i < 2 * nflows; i++)
+    timerfd[i] = -1;
+
+  epfd = epoll_create1(0);
+  if (epfd < 0)
+    fail("epoll_create1");
+  makesockets();
+  watch(sock[A], TOKEN(EV_SOCKET, A, 0));
+  watch(sock[B], TOKEN(EV_SOCKET, B, 0));
+  arrivalfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (arrivalfd < 0)
+    fail("timerfd_create");
+  watch(arrivalfd, TOKEN(EV_ARRIVAL, A, 0));
+
+  pstate = proto->create(window);
+  useprotocol(proto, pstate);
+
+  start = now_us();
+  idle_since = start;
+  arrival();
+  /* run until every accepted message is delivered, or nothing has been
+     delivered for a thousand RTTs' worth of time units after the last arrival */
+  while (nsim < nsimmax || delivered < accepted) {
+    n = epoll_wait(epfd, evs, 64, 100);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fail("epoll_wait");
+    }
+    for (i = 0; i < n; i++) {
+      token = evs[i].data.u64;
+      kind = token & 3;
+      AorB = (token >> 2) & 1;
+      flow = token >> 3;
+      if (kind == EV_SOCKET) {
+        receive(AorB);
+        idle_since = now_us();
+      }
+      else if (read(kind == EV_ARRIVAL ? arrivalfd : timerfd[AorB*nflows + flow],
+                    &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        if (kind == EV_ARRIVAL)
+          arrival();
+        else {
+          timerarmed[AorB*nflows + flow] = 0;
+          if (AorB == A)
+            proto->A_timerinterrupt(pstate, flow);
+          else
+            proto->B_timerinterrupt(pstate);
+        }
+      }
+    }
+    if (nsim >= nsimmax && now_us() - idle_since > 16000.0 * unit_us) {
+      printf("giving up: no packets for %.0f ms\n", 16000.0 * unit_us / 1e3);
+      break;
+    }
+  }
+  elapsed = now_us() - start;
+
+  printf("UDP loopback run of %s, window %d: %d msgs from layer5, %d accepted, %d delivered\n", proto->name, window, nsim, accepted, delivered);
+  printf("time unit = %.1f us, loss %.3f, corruption %.3f, %d flows\n", unit_us, lossprob, corruptprob, nflows);
+  printf("number of messages dropped due to full window:  %d \n", window_full);
+  printf("number of packet resends by A:  %d \n", packets_resent);
+  if (nacks)
+    printf("number of NACKs sent by B:  %d, packets resent on a NACK:  %d \n", nacks_sent, nack_resends);
+  if (fec)
+    printf("number of parity packets sent by A:  %d, packets rebuilt from parity at B:  %d \n", parity_sent, fec_recovered);
+  printf("packets sent into layer 3:  %d (%d lost, %d corrupted)\n", ntolayer3, nlost, ncorrupt);
+  printf("elapsed wall time:  %.3f s (%.1f time units)\n", elapsed / 1e6, elapsed / unit_us);
+  printf("packets per second:  %.0f \n", ntolayer3 / (elapsed / 1e6));
+  printf("messages delivered per second:  %.0f (%.4f per time unit)\n",
+         delivered / (elapsed / 1e6), delivered / (elapsed / unit_us));
+  printf("goodput:  %.0f bytes per second \n", bytes_delivered / (elapsed / 1e6));
+  if (delivered > 0) {
+    qsort(latencies, delivered, sizeof(double), cmpdouble);
+    for (sum = 0.0, i = 0; i < delivered; i++)
+      sum += latencies[i];
+    printf("message delay from A's layer 5 to B's layer 5 (us):  average %.1f, p50 %.1f, p99 %.1f, max %.1f \n",
+           sum / delivered, latencies[delivered / 2], latencies[(int)(delivered * 0.99)],
+           latencies[delivered - 1]);
+    printf("  in time units, to compare with the emulator:  average %f, max %f \n",
+           sum / delivered / unit_us, latencies[delivered - 1] / unit_us);
+  }
+  return EXIT_SUCCESS;
+}